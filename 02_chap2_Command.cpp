@@ -141,4 +141,837 @@ private:
   Unit* unit_;
   int x_, y_;
   int xBefore_, yBefore_;
-};
\ No newline at end of file
+};
+
+/*************************
+  2.4 値型のコマンド（スモールバッファ最適化）
+**************************/
+//  2.3のCommandはnewで確保され、vtable経由で呼ばれる。
+//  InputHandlerや履歴はCommand*を持つので、実行のたびにポインタを辿ることになる。
+//  小さなコマンドなら、オブジェクトの中にそのまま埋め込んで値として扱える。
+//  execute()/undo()を持つ型なら何でも格納できる（ムーブのみ可能）
+#include <cstddef>
+#include <cstdio>
+#include <chrono>
+#include <new>
+#include <utility>
+#include <vector>
+
+class InlineCommand {
+public:
+  static const size_t BUFFER_SIZE = 32;
+
+  InlineCommand()
+  : execute_(NULL), ops_(NULL)
+  { }
+
+  template <class T>
+  InlineCommand(T command)
+  : execute_(&Ops<T>::execute), ops_(&Ops<T>::table)
+  {
+    static_assert(sizeof(T) <= BUFFER_SIZE, "command does not fit in the inline buffer");
+    static_assert(alignof(T) <= alignof(std::max_align_t), "command is over-aligned");
+    new (buffer_) T(std::move(command));
+  }
+
+  InlineCommand(InlineCommand&& other)
+  : execute_(other.execute_), ops_(other.ops_)
+  {
+    if (ops_) {
+      ops_->move(buffer_, other.buffer_);
+      other.reset();
+    }
+  }
+
+  InlineCommand& operator=(InlineCommand&& other) {
+    if (this != &other) {
+      reset();
+      execute_ = other.execute_;
+      ops_ = other.ops_;
+      if (ops_) {
+        ops_->move(buffer_, other.buffer_);
+        other.reset();
+      }
+    }
+    return *this;
+  }
+
+  InlineCommand(const InlineCommand&) = delete;
+  InlineCommand& operator=(const InlineCommand&) = delete;
+
+  ~InlineCommand() { reset(); }
+
+  // 実行は関数ポインタを１つ呼ぶだけ（vtableを辿らない）
+  void execute() { execute_(buffer_); }
+  void undo()    { ops_->undo(buffer_); }
+
+  explicit operator bool() const { return execute_ != NULL; }
+
+private:
+  struct Table {
+    void (*undo)(void* self);
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void* self);
+  };
+
+  template <class T>
+  struct Ops {
+    static void execute(void* self) { static_cast<T*>(self)->execute(); }
+    static void undo(void* self)    { static_cast<T*>(self)->undo(); }
+    static void move(void* dst, void* src) {
+      new (dst) T(std::move(*static_cast<T*>(src)));
+    }
+    static void destroy(void* self) { static_cast<T*>(self)->~T(); }
+
+    static const Table table;
+  };
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(buffer_);
+      execute_ = NULL;
+      ops_ = NULL;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buffer_[BUFFER_SIZE];
+  void (*execute_)(void* self);
+  const Table* ops_;
+};
+
+template <class T>
+const InlineCommand::Table InlineCommand::Ops<T>::table = {
+  &InlineCommand::Ops<T>::undo,
+  &InlineCommand::Ops<T>::move,
+  &InlineCommand::Ops<T>::destroy,
+};
+
+//  2.3のMoveUnitCommandと同じ中身を、仮想関数なしの値型で書く
+struct MoveUnit {
+  Unit* unit_;
+  int x_, y_;
+  int xBefore_, yBefore_;
+
+  void execute() {
+    xBefore_ = unit_->x();
+    yBefore_ = unit_->y();
+    unit_->moveTo(x_, y_);
+  }
+
+  void undo() {
+    unit_->moveTo(xBefore_, yBefore_);
+  }
+};
+
+//  コマンドはvectorにそのまま並び、ヒープ確保はvector自身の１回だけ
+std::vector<InlineCommand> history;
+history.push_back(InlineCommand(MoveUnit{ unit, unit->x(), unit->y() - 1, 0, 0 }));
+history.back().execute();
+
+//  仮想関数版との比較
+//    dispatch : Command*をvectorに並べたものとInlineCommandを並べたものをそれぞれ実行
+//    memory   : コマンド１つあたりのバイト数（仮想版はポインタ＋ヒープ上の本体）
+void benchmarkCommandDispatch(Unit* unit, int count) {
+  typedef std::chrono::steady_clock Clock;
+
+  std::vector<Command*> virtualCommands;
+  std::vector<InlineCommand> inlineCommands;
+  virtualCommands.reserve(count);
+  inlineCommands.reserve(count);
+  for (int i = 0; i < count; i++) {
+    virtualCommands.push_back(new MoveUnitCommand(unit, i, -i));
+    inlineCommands.push_back(InlineCommand(MoveUnit{ unit, i, -i, 0, 0 }));
+  }
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < virtualCommands.size(); i++) virtualCommands[i]->execute();
+  for (size_t i = virtualCommands.size(); i > 0; i--) virtualCommands[i - 1]->undo();
+  Clock::time_point middle = Clock::now();
+  for (size_t i = 0; i < inlineCommands.size(); i++) inlineCommands[i].execute();
+  for (size_t i = inlineCommands.size(); i > 0; i--) inlineCommands[i - 1].undo();
+  Clock::time_point end = Clock::now();
+
+  typedef std::chrono::duration<double, std::nano> Nanoseconds;
+  printf("virtual: %.2f ns/cmd, %zu bytes/cmd (+ malloc header)\n",
+         Nanoseconds(middle - start).count() / count,
+         sizeof(Command*) + sizeof(MoveUnitCommand));
+  printf("inline : %.2f ns/cmd, %zu bytes/cmd\n",
+         Nanoseconds(end - middle).count() / count,
+         sizeof(InlineCommand));
+
+  for (size_t i = 0; i < virtualCommands.size(); i++) delete virtualCommands[i];
+}
+
+
+/*************************
+  2.5 テーブル駆動の入力処理
+**************************/
+//  2.2のhandleInput()はif/else ifの連鎖で、１フレームに返せるコマンドは１つだけ。
+//  同時押しは捨てられ、isPressed()のたびにデバイスを読みに行くかもしれない。
+//  そこで、
+//    - フレームの最初にデバイスの状態を１回だけ読み、ビットマスクに保存する
+//    - 押された／離された瞬間はビット演算で求める
+//    - コマンドはボタンを添字とするテーブルから引く
+#include <cstdint>
+
+enum Button {
+  BUTTON_X,
+  BUTTON_Y,
+  BUTTON_A,
+  BUTTON_B,
+  BUTTON_UP,
+  BUTTON_DOWN,
+  BUTTON_LEFT,
+  BUTTON_RIGHT,
+
+  BUTTON_COUNT
+};
+
+typedef uint32_t ButtonMask;
+static_assert(BUTTON_COUNT < 32, "ButtonMask is too narrow");
+
+inline ButtonMask buttonBit(Button button) { return ButtonMask(1) << button; }
+
+//  割り当てテーブルはBUTTON_COUNT個しかないので、それより上のビットは捨てる
+const ButtonMask ALL_BUTTONS = (ButtonMask(1) << BUTTON_COUNT) - 1;
+
+//  デバイス全体の状態を１回で読む（プラットフォーム依存）
+ButtonMask pollButtons();
+
+struct InputSnapshot {
+  ButtonMask down;      // 押されている
+  ButtonMask pressed;   // このフレームで押された
+  ButtonMask released;  // このフレームで離された
+};
+
+class InputSampler {
+public:
+  InputSampler()
+  : previous_(0)
+  { }
+
+  InputSnapshot sample() {
+    ButtonMask current = pollButtons() & ALL_BUTTONS;
+    InputSnapshot snapshot;
+    snapshot.down     = current;
+    snapshot.pressed  = current & ~previous_;
+    snapshot.released = ~current & previous_;
+    previous_ = current;
+    return snapshot;
+  }
+
+private:
+  ButtonMask previous_;
+};
+
+//  何もしないコマンド。空いているスロットをこれで埋めておけば、
+//  ディスパッチ時にNULLチェックが要らない
+class NullCommand : public Command {
+public:
+  virtual void execute(GameActor& actor) { }
+};
+
+class InputHandler {
+public:
+  enum Edge {
+    EDGE_PRESSED,
+    EDGE_RELEASED,
+    EDGE_HELD,
+
+    EDGE_COUNT
+  };
+
+  InputHandler() {
+    for (int edge = 0; edge < EDGE_COUNT; edge++) {
+      for (int button = 0; button < BUTTON_COUNT; button++) {
+        bindings_[edge][button] = &nullCommand_;
+      }
+    }
+  }
+
+  //  実行中に割り当てを変えるのはテーブルへの代入だけ
+  void bind(Button button, Edge edge, Command* command) {
+    bindings_[edge][button] = command ? command : &nullCommand_;
+  }
+
+  void unbind(Button button, Edge edge) {
+    bindings_[edge][button] = &nullCommand_;
+  }
+
+  //  立っているビットだけを順に取り出してディスパッチする。
+  //  同時に押されたボタンはすべて同じフレームで実行される
+  void handleInput(const InputSnapshot& input, GameActor& actor) {
+    dispatch(bindings_[EDGE_PRESSED], input.pressed, actor);
+    dispatch(bindings_[EDGE_HELD], input.down, actor);
+    dispatch(bindings_[EDGE_RELEASED], input.released, actor);
+  }
+
+private:
+  static void dispatch(Command* const* table, ButtonMask mask, GameActor& actor) {
+    while (mask) {
+      int button = __builtin_ctz(mask);
+      mask &= mask - 1;  // 最下位のビットを落とす
+      table[button]->execute(actor);
+    }
+  }
+
+  Command* bindings_[EDGE_COUNT][BUTTON_COUNT];
+  NullCommand nullCommand_;
+};
+
+InputSampler sampler;
+InputSnapshot input = sampler.sample();
+inputHandler.handleInput(input, actor);
+
+
+/*************************
+  2.6 コマンドの並列実行
+**************************/
+//  2.2のcommand->execute(actor)は、handleInput()を呼んだスレッドで１つずつ実行される。
+//  RTSで数千のユニットに移動を指示するような場合、ほとんどのコマンドは別々のアクターにしか触らない。
+//  そこで、１フレーム分のコマンドを溜めておき、触るアクターでグループ分けする。
+//    - 同じアクターに触るコマンドは同じグループに入り、発行順に直列で実行される
+//    - 別のグループ同士は共有するものがないので、ワーカースレッドで並列に実行できる
+//  グループ内の順序は保たれ、グループ間は独立なので、結果は直列実行と同じになる
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+class CommandScheduler {
+public:
+  explicit CommandScheduler(int workerCount)
+  : generation_(0), nextGroup_(0), finishedWorkers_(0), quit_(false)
+  {
+    for (int i = 0; i < workerCount; i++) {
+      workers_.push_back(std::thread(&CommandScheduler::workerLoop, this));
+    }
+  }
+
+  ~CommandScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+  }
+
+  //  actorに対してcommandを実行する。
+  //  commandがactor以外のアクター（攻撃対象など）にも触るなら、それをotherに渡す
+  void submit(Command* command, GameActor* actor, GameActor* other = NULL) {
+    Entry entry = { command, actor, other };
+    entries_.push_back(entry);
+  }
+
+  //  溜めたコマンドをすべて実行し、終わるまで待つ
+  void flush() {
+    if (entries_.empty()) return;
+
+    buildGroups();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      nextGroup_ = 0;
+      finishedWorkers_ = 0;
+      generation_++;
+    }
+    wake_.notify_all();
+
+    // 呼び出したスレッドも手伝う
+    runGroups();
+
+    // 全ワーカーがこの世代を抜けるまで待つ。
+    // そうしないと、遅れたワーカーが次のbuildGroups()と競合する
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return finishedWorkers_ == workers_.size(); });
+
+    entries_.clear();
+  }
+
+private:
+  struct Entry {
+    Command* command;
+    GameActor* actor;
+    GameActor* other;
+  };
+
+  int find(int i) {
+    while (parent_[i] != i) {
+      parent_[i] = parent_[parent_[i]];
+      i = parent_[i];
+    }
+    return i;
+  }
+
+  void unite(int a, int b) {
+    a = find(a);
+    b = find(b);
+    if (a != b) parent_[std::max(a, b)] = std::min(a, b);
+  }
+
+  void touch(int entry, GameActor* actor) {
+    if (!actor) return;
+    std::pair<std::unordered_map<GameActor*, int>::iterator, bool> result =
+        lastToucher_.insert(std::make_pair(actor, entry));
+    if (!result.second) {
+      unite(result.first->second, entry);
+      result.first->second = entry;
+    }
+  }
+
+  //  Union-Findでコマンドを連結成分に分け、成分ごとに発行順で並べる
+  void buildGroups() {
+    int count = (int)entries_.size();
+    parent_.resize(count);
+    for (int i = 0; i < count; i++) parent_[i] = i;
+
+    lastToucher_.clear();
+    for (int i = 0; i < count; i++) {
+      touch(i, entries_[i].actor);
+      touch(i, entries_[i].other);
+    }
+
+    // 根の添字は成分内で最小なので、(根, 発行順)で安定に並べれば
+    // 成分ごとに連続し、成分内は発行順になる
+    order_.resize(count);
+    for (int i = 0; i < count; i++) order_[i] = i;
+    for (int i = 0; i < count; i++) parent_[i] = find(i);
+    std::stable_sort(order_.begin(), order_.end(),
+                     [this](int a, int b) { return parent_[a] < parent_[b]; });
+
+    groupStarts_.clear();
+    for (int i = 0; i < count; i++) {
+      if (i == 0 || parent_[order_[i]] != parent_[order_[i - 1]]) {
+        groupStarts_.push_back(i);
+      }
+    }
+    groupStarts_.push_back(count);
+  }
+
+  void runGroups() {
+    size_t groupCount = groupStarts_.size() - 1;
+    for (;;) {
+      size_t group = nextGroup_.fetch_add(1);
+      if (group >= groupCount) return;
+
+      for (int i = groupStarts_[group]; i < groupStarts_[group + 1]; i++) {
+        Entry& entry = entries_[order_[i]];
+        entry.command->execute(*entry.actor);
+      }
+    }
+  }
+
+  void workerLoop() {
+    unsigned seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+        if (quit_) return;
+        seen = generation_;
+      }
+      runGroups();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (++finishedWorkers_ == workers_.size()) done_.notify_one();
+    }
+  }
+
+  std::vector<Entry> entries_;
+  std::vector<int> parent_;
+  std::vector<int> order_;
+  std::vector<int> groupStarts_;
+  std::unordered_map<GameActor*, int> lastToucher_;
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  unsigned generation_;
+  std::atomic<size_t> nextGroup_;
+  size_t finishedWorkers_;
+  bool quit_;
+};
+
+CommandScheduler scheduler(std::thread::hardware_concurrency() - 1);
+for (size_t i = 0; i < selectedUnits.size(); i++) {
+  scheduler.submit(moveCommand, selectedUnits[i]);
+}
+scheduler.flush();
+
+
+/*************************
+  2.7 コマンド列の記録と再生
+**************************/
+//  コマンドの列はそのままリプレイのログになる。
+//  ただしMoveUnitCommandはUnit*を持つので、そのままではファイルに書けない。
+//  ポインタの代わりにエンティティIDを書き、引数は可変長整数（varint）で詰める。
+//    レコード : [種類 1byte][エンティティID varint][引数 varint ...]
+//    フレームの区切りにはCOMMAND_END_FRAMEを置く
+//  同じ入力列を同じ順に再生すれば、ロックステップでも同じ結果になる
+#include <cstring>
+
+enum CommandType {
+  COMMAND_END_FRAME,
+  COMMAND_MOVE_UNIT,
+};
+
+//  エンティティIDとUnit*の対応はワールドが持つ
+uint32_t unitId(const Unit* unit);
+Unit* findUnit(uint32_t id);
+
+class CommandEncoder {
+public:
+  void moveUnit(const Unit* unit, int x, int y) {
+    put(COMMAND_MOVE_UNIT);
+    putVarint(unitId(unit));
+    putSigned(x);
+    putSigned(y);
+  }
+
+  void endFrame() { put(COMMAND_END_FRAME); }
+
+  const std::vector<uint8_t>& bytes() const { return bytes_; }
+  void clear() { bytes_.clear(); }
+
+private:
+  void put(uint8_t byte) { bytes_.push_back(byte); }
+
+  //  下位7ビットずつ、続きがあれば最上位ビットを立てる
+  void putVarint(uint32_t value) {
+    while (value >= 0x80) {
+      put(uint8_t(value | 0x80));
+      value >>= 7;
+    }
+    put(uint8_t(value));
+  }
+
+  //  ZigZag符号化：0, -1, 1, -2, ... を 0, 1, 2, 3, ... に写す
+  void putSigned(int32_t value) {
+    putVarint((uint32_t(value) << 1) ^ uint32_t(value >> 31));
+  }
+
+  std::vector<uint8_t> bytes_;
+};
+
+enum DecodeResult {
+  DECODED_COMMAND,
+  DECODED_END_FRAME,
+  DECODE_ERROR,       //  途中で切れている、知らない種類、不正なvarint、存在しないID
+};
+
+class CommandDecoder {
+public:
+  CommandDecoder(const uint8_t* data, size_t size)
+  : begin_(data), cur_(data), end_(data + size), errorOffset_(0)
+  { }
+
+  bool done() const { return cur_ >= end_; }
+
+  //  DECODE_ERRORを返したあとは、そのレコードの先頭の位置
+  size_t errorOffset() const { return errorOffset_; }
+
+  //  次のレコードを読み、実行できるコマンドにする（2.4のInlineCommandなのでヒープ確保はない）
+  //  クラッシュで書きかけのまま終わった記録もあるので、読むたびに範囲を確かめる。
+  //  壊れていたらDECODE_ERRORを返し、以降は読まない
+  DecodeResult next(InlineCommand& command) {
+    const uint8_t* record = cur_;
+    uint8_t type;
+    if (!get(type)) return fail(record);
+
+    switch (type) {
+      case COMMAND_MOVE_UNIT: {
+        uint32_t id;
+        int32_t x, y;
+        if (!getVarint(id) || !getSigned(x) || !getSigned(y)) return fail(record);
+        Unit* unit = findUnit(id);
+        if (!unit) return fail(record);
+        command = InlineCommand(MoveUnit{ unit, x, y, 0, 0 });
+        return DECODED_COMMAND;
+      }
+
+      case COMMAND_END_FRAME:
+        return DECODED_END_FRAME;
+
+      default:
+        return fail(record);
+    }
+  }
+
+private:
+  //  uint32_tのvarintは最長5バイト。5バイト目に使えるのは下位4ビットだけ
+  static const int MAX_VARINT_BYTES = 5;
+
+  bool get(uint8_t& byte) {
+    if (cur_ >= end_) return false;
+    byte = *cur_++;
+    return true;
+  }
+
+  bool getVarint(uint32_t& value) {
+    value = 0;
+    for (int i = 0; i < MAX_VARINT_BYTES; i++) {
+      uint8_t byte;
+      if (!get(byte)) return false;
+      if (i == MAX_VARINT_BYTES - 1 && byte > 0x0f) return false;
+      value |= uint32_t(byte & 0x7f) << (7 * i);
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool getSigned(int32_t& value) {
+    uint32_t zigzag;
+    if (!getVarint(zigzag)) return false;
+    value = int32_t(zigzag >> 1) ^ -int32_t(zigzag & 1);
+    return true;
+  }
+
+  DecodeResult fail(const uint8_t* record) {
+    errorOffset_ = size_t(record - begin_);
+    cur_ = end_;
+    return DECODE_ERROR;
+  }
+
+  const uint8_t* begin_;
+  const uint8_t* cur_;
+  const uint8_t* end_;
+  size_t errorOffset_;
+};
+
+//  ゲームスレッドはメモリ上のバッファに符号化するだけで、ファイルへの書き込みは
+//  バックグラウンドのスレッドが行う。フレームの終わりにバッファを入れ替える
+class CommandRecorder {
+public:
+  explicit CommandRecorder(FILE* file)
+  : file_(file), quit_(false), thread_(&CommandRecorder::writerLoop, this)
+  { }
+
+  ~CommandRecorder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+    fwrite(encoder_.bytes().data(), 1, encoder_.bytes().size(), file_);
+    fflush(file_);
+  }
+
+  CommandEncoder& encoder() { return encoder_; }
+
+  void endFrame() {
+    encoder_.endFrame();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::vector<uint8_t>& bytes = encoder_.bytes();
+    pending_.insert(pending_.end(), bytes.begin(), bytes.end());
+    encoder_.clear();
+    wake_.notify_one();
+  }
+
+private:
+  void writerLoop() {
+    std::vector<uint8_t> writing;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return quit_ || !pending_.empty(); });
+        if (pending_.empty() && quit_) return;
+        writing.swap(pending_);
+      }
+      fwrite(writing.data(), 1, writing.size(), file_);
+      writing.clear();
+    }
+  }
+
+  FILE* file_;
+  CommandEncoder encoder_;
+  std::vector<uint8_t> pending_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool quit_;
+  std::thread thread_;
+};
+
+//  記録したセッションを描画なしで最大速度で再実行し、シミュレーションのスループットを測る
+void benchmarkReplay(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return;
+
+  std::vector<uint8_t> data;
+  uint8_t chunk[64 * 1024];
+  size_t read;
+  while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + read);
+  }
+  fclose(file);
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+
+  CommandDecoder decoder(data.data(), data.size());
+  long commands = 0;
+  long frames = 0;
+  InlineCommand command;
+  while (!decoder.done()) {
+    DecodeResult result = decoder.next(command);
+    if (result == DECODED_COMMAND) {
+      command.execute();
+      commands++;
+    } else if (result == DECODED_END_FRAME) {
+      frames++;
+    } else {
+      printf("%s: corrupt record at offset %zu, replay stopped\n", path, decoder.errorOffset());
+      break;
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  printf("replayed %ld commands in %ld frames: %.3f s, %.1f Mcmd/s, %.2f bytes/cmd\n",
+         commands, frames, seconds, commands / seconds / 1e6,
+         commands ? double(data.size()) / commands : 0.0);
+}
+
+
+/*************************
+  2.8 コマンドの結合
+**************************/
+//  方向ボタンを押し続けると、１歩ごとに新しいMoveUnitCommandが作られ、
+//  それぞれが取り消し用の履歴を１つずつ消費する。
+//  同じユニットへの連続した移動なら、最初の「移動前」の位置と最後の移動先だけを持つ
+//  １つのコマンドにまとめてしまえばよい
+class Command {
+public:
+  enum MergeKind {
+    MERGE_NONE,
+    MERGE_MOVE_UNIT,
+  };
+
+  virtual ~Command() { }
+  virtual void execute() = 0;
+  virtual void undo() = 0;
+
+  //  nextをこのコマンドに吸収できればtrueを返す（nextは捨ててよい）
+  virtual MergeKind mergeKind() const { return MERGE_NONE; }
+  virtual bool mergeWith(const Command& next) { return false; }
+};
+
+class MoveUnitCommand : public Command {
+public:
+  MoveUnitCommand(Unit* unit, int x, int y)
+  : unit_(unit), x_(x), y_(y), xBefore_(0), yBefore_(0)
+  { }
+
+  virtual void execute() {
+    xBefore_ = unit_->x();
+    yBefore_ = unit_->y();
+    unit_->moveTo(x_, y_);
+  }
+
+  virtual void undo() {
+    unit_->moveTo(xBefore_, yBefore_);
+  }
+
+  virtual MergeKind mergeKind() const { return MERGE_MOVE_UNIT; }
+
+  //  移動先だけを差し替え、xBefore_/yBefore_は最初のものを残す
+  virtual bool mergeWith(const Command& next) {
+    if (next.mergeKind() != MERGE_MOVE_UNIT) return false;
+
+    const MoveUnitCommand& move = static_cast<const MoveUnitCommand&>(next);
+    if (move.unit_ != unit_) return false;
+
+    x_ = move.x_;
+    y_ = move.y_;
+    return true;
+  }
+
+private:
+  Unit* unit_;
+  int x_, y_;
+  int xBefore_, yBefore_;
+};
+
+//  取り消し／再実行の履歴。
+//  直前のコマンドからMERGE_WINDOWフレーム以内に来たコマンドは、結合できればまとめる
+class CommandHistory {
+public:
+  static const int MERGE_WINDOW = 10;
+
+  CommandHistory()
+  : current_(0)
+  { }
+
+  ~CommandHistory() {
+    for (size_t i = 0; i < entries_.size(); i++) delete entries_[i].command;
+  }
+
+  void execute(Command* command, int frame) {
+    command->execute();
+
+    // 取り消した分より先は捨てる
+    for (size_t i = current_; i < entries_.size(); i++) delete entries_[i].command;
+    entries_.resize(current_);
+
+    if (!entries_.empty()) {
+      Entry& last = entries_.back();
+      if (frame - last.frame <= MERGE_WINDOW && last.command->mergeWith(*command)) {
+        last.frame = frame;
+        delete command;
+        return;
+      }
+    }
+
+    Entry entry = { command, frame };
+    entries_.push_back(entry);
+    current_ = entries_.size();
+  }
+
+  void undo() {
+    if (current_ == 0) return;
+    entries_[--current_].command->undo();
+  }
+
+  void redo() {
+    if (current_ == entries_.size()) return;
+    entries_[current_++].command->execute();
+  }
+
+private:
+  struct Entry {
+    Command* command;
+    int frame;  // 最後に結合したフレーム
+  };
+
+  std::vector<Entry> entries_;
+  size_t current_;
+};
+
+//  まだ実行していないコマンドの待ち行列でも同じように結合すれば、
+//  同じフレームに溜まった移動は最後の移動先への１回の実行で済む
+class CommandQueue {
+public:
+  ~CommandQueue() {
+    for (size_t i = 0; i < pending_.size(); i++) delete pending_[i];
+  }
+
+  void push(Command* command) {
+    if (!pending_.empty() && pending_.back()->mergeWith(*command)) {
+      delete command;
+      return;
+    }
+    pending_.push_back(command);
+  }
+
+  void flush(CommandHistory& history, int frame) {
+    for (size_t i = 0; i < pending_.size(); i++) history.execute(pending_[i], frame);
+    pending_.clear();
+  }
+
+private:
+  std::vector<Command*> pending_;
+};
@@ -157,3 +157,1175 @@ public:
 Spawner* ghostSpawner = new SpawnerFor<Ghost>();
 Ghost* ghost = ghostSpanwer.spawnMonster();
 
+
+
+
+/*
+	5.1.4	まとめて生成する
+*/
+/*
+	spawnMonster()はclone()を呼び、clone()はnew Ghostを行う
+	5000匹の群れを出せば、5000回のヒープ確保になる
+	プロトタイプにまとめて複製させ、あらかじめ確保した領域にコピーコンストラクトすれば
+	確保は１回、virtual呼び出しも１回で済む
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+class Monster {
+public:
+	virtual ~Monster() {}
+	virtual Monster* clone() = 0;
+
+	// 自分と同じ型の領域１つ分のバイト数
+	virtual size_t cloneSize() const = 0;
+	// placeからcount個、自分のコピーを並べて構築する
+	virtual void cloneInto(void* place, size_t count) const = 0;
+};
+
+class Ghost : public Monster {
+public:
+	Ghost(int health, int speed)
+	: health_(health),
+	  speed_(speed)
+	  {}
+
+	virtual Monster* clone() {
+		return new Ghost(health_, speed_);
+	}
+
+	virtual size_t cloneSize() const { return sizeof(Ghost); }
+
+	// 型がわかっているのでコピーコンストラクタはインライン展開され、単純なコピーの繰り返しになる
+	virtual void cloneInto(void* place, size_t count) const {
+		Ghost* ghosts = static_cast<Ghost*>(place);
+		for (size_t i = 0; i < count; i++) {
+			new (&ghosts[i]) Ghost(*this);
+		}
+	}
+
+private:
+	int health_;
+	int speed_;
+};
+
+/*
+	同じ型の怪物を詰めて置く領域
+	容量が足りていれば再確保しないので、毎ウェーブ使い回せる
+*/
+class MonsterArena {
+public:
+	MonsterArena()
+	: data_(NULL),
+	  capacity_(0),
+	  stride_(0),
+	  count_(0)
+	  {}
+
+	~MonsterArena() {
+		clear();
+		free(data_);
+	}
+
+	size_t size() const { return count_; }
+	size_t capacity() const { return capacity_; }
+	Monster* operator[](size_t i) {
+		return reinterpret_cast<Monster*>(data_ + i * stride_);
+	}
+
+	void clear() {
+		for (size_t i = 0; i < count_; i++) {
+			(*this)[i]->~Monster();
+		}
+		count_ = 0;
+	}
+
+	// count個分の領域を確保して返す。以前の中身は破棄する
+	void* allocate(size_t count, size_t stride) {
+		clear();
+		if (count * stride > capacity_) {
+			free(data_);
+			capacity_ = count * stride;
+			data_ = static_cast<char*>(malloc(capacity_));
+		}
+		stride_ = stride;
+		count_ = count;
+		return data_;
+	}
+
+private:
+	char* data_;
+	size_t capacity_;
+	size_t stride_;
+	size_t count_;
+};
+
+class Spawner {
+public:
+	Spawner(Monster* prototype)
+	: prototype_(prototype)
+	{}
+
+	Monster* spawnMonster() {
+		return prototype_->clone();
+	}
+
+	void spawnMonsters(size_t n, MonsterArena& out) {
+		void* place = out.allocate(n, prototype_->cloneSize());
+		prototype_->cloneInto(place, n);
+	}
+
+private:
+	Monster* prototype_;
+};
+
+/*
+	clone()を１匹ずつ呼ぶ場合とまとめて生成する場合の比較
+*/
+void benchmarkSpawn(size_t count) {
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::nano> Nanoseconds;
+
+	Ghost prototype(15, 3);
+	Spawner spawner(&prototype);
+
+	std::vector<Monster*> monsters;
+	monsters.reserve(count);
+
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; i++) {
+		monsters.push_back(spawner.spawnMonster());
+	}
+	Clock::time_point middle = Clock::now();
+
+	MonsterArena arena;
+	spawner.spawnMonsters(count, arena);
+	Clock::time_point end = Clock::now();
+
+	printf("clone()       : %.2f ns/monster, %zu allocations\n",
+		Nanoseconds(middle - start).count() / count, count);
+	printf("spawnMonsters : %.2f ns/monster, 1 allocation\n",
+		Nanoseconds(end - middle).count() / count);
+
+	for (size_t i = 0; i < monsters.size(); i++) {
+		delete monsters[i];
+	}
+}
+
+
+
+/*
+	5.1.5	データで定義するプロトタイプ
+*/
+/*
+	これまでのプロトタイプはコードの中でnew Ghost(15, 3)として作っていた
+	怪物の種類をデータファイルに書き、ロード時にレジストリへ登録する
+		- "prototype"で親を指定すると、親の値を引き継いで必要なフィールドだけ上書きできる
+		- 継承はロード時に１回だけ解決し、平坦で不変なレコードにしてしまう
+		- 生成はレコードのコピーだけ。virtualなclone()は呼ばない
+	ソースはJSON（の小さなサブセット）で書く
+
+	[
+		{ "name": "goblin grunt", "health": 20, "speed": 3, "attack": 4 },
+		{ "name": "goblin wizard", "prototype": "goblin grunt", "attack": 9, "resists": 2 }
+	]
+
+	平坦化したレコードはそのままバイナリファイルに書き出せる
+	起動時はそれをmmapするだけなので、数千種類あってもパースも確保もない
+*/
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 平坦化済みのレコード。ポインタを持たないのでそのままファイルに置ける
+struct MonsterStats {
+	uint32_t nameHash;
+	int32_t health;
+	int32_t speed;
+	int32_t attack;
+	uint32_t resists;	// 耐性のビット集合
+};
+
+inline uint32_t hashName(const char* name, size_t length) {
+	uint32_t hash = 2166136261u;	// FNV-1a
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ uint8_t(name[i])) * 16777619u;
+	}
+	return hash;
+}
+
+class ArchetypeRegistry {
+public:
+	ArchetypeRegistry()
+	: records_(NULL),
+	  count_(0),
+	  mapping_(NULL),
+	  mappingSize_(0)
+	  {}
+
+	~ArchetypeRegistry() { unmap(); }
+
+	bool loadJson(const char* text);
+	bool saveBinary(const char* path) const;
+	bool mapBinary(const char* path);
+
+	// 名前から添字を引くのはロード後の１回だけにして、以後は添字で生成する
+	int find(const char* name) const {
+		uint32_t hash = hashName(name, strlen(name));
+		const MonsterStats* end = records_ + count_;
+		const MonsterStats* found = std::lower_bound(records_, end, hash,
+			[](const MonsterStats& record, uint32_t h) { return record.nameHash < h; });
+		return (found != end && found->nameHash == hash) ? int(found - records_) : -1;
+	}
+
+	size_t size() const { return count_; }
+	const MonsterStats& get(int index) const { return records_[index]; }
+
+	void spawn(int index, size_t n, std::vector<MonsterStats>& out) const {
+		out.insert(out.end(), n, records_[index]);
+	}
+
+private:
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t count;
+		uint32_t recordSize;
+	};
+
+	static const uint32_t MAGIC = 0x48435241;	// "ARCH"
+	static const uint32_t VERSION = 1;
+
+	// パース中の１エントリ。setは明示されたフィールドのビット
+	struct Source {
+		std::string name;
+		std::string parent;
+		MonsterStats stats;
+		uint32_t set;
+		int state;	// 0: 未解決 1: 解決中 2: 解決済み
+	};
+
+	enum Field {
+		FIELD_HEALTH = 1 << 0,
+		FIELD_SPEED = 1 << 1,
+		FIELD_ATTACK = 1 << 2,
+		FIELD_RESISTS = 1 << 3,
+	};
+
+	typedef std::unordered_map<std::string, size_t> NameIndex;
+
+	static bool resolve(std::vector<Source>& sources, const NameIndex& byName, size_t index);
+	void unmap();
+
+	std::vector<MonsterStats> owned_;
+	const MonsterStats* records_;
+	size_t count_;
+	void* mapping_;
+	size_t mappingSize_;
+};
+
+namespace {
+
+void skipSpace(const char*& p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == ',' || *p == ':') p++;
+}
+
+bool parseString(const char*& p, std::string& out) {
+	skipSpace(p);
+	if (*p != '"') return false;
+	const char* start = ++p;
+	while (*p && *p != '"') p++;
+	if (!*p) return false;
+	out.assign(start, p++);
+	return true;
+}
+
+bool parseInt(const char*& p, int32_t& out) {
+	skipSpace(p);
+	char* end;
+	long value = strtol(p, &end, 10);
+	if (end == p) return false;
+	out = int32_t(value);
+	p = end;
+	return true;
+}
+
+}
+
+bool ArchetypeRegistry::loadJson(const char* text) {
+	std::vector<Source> sources;
+
+	const char* p = text;
+	skipSpace(p);
+	if (*p++ != '[') return false;
+
+	for (;;) {
+		skipSpace(p);
+		if (*p == ']') break;
+		if (*p++ != '{') return false;
+
+		Source source = Source();
+		for (;;) {
+			skipSpace(p);
+			if (*p == '}') { p++; break; }
+
+			std::string key;
+			if (!parseString(p, key)) return false;
+
+			int32_t value = 0;
+			if (key == "name") {
+				if (!parseString(p, source.name)) return false;
+			} else if (key == "prototype") {
+				if (!parseString(p, source.parent)) return false;
+			} else if (!parseInt(p, value)) {
+				return false;
+			} else if (key == "health") {
+				source.stats.health = value;
+				source.set |= FIELD_HEALTH;
+			} else if (key == "speed") {
+				source.stats.speed = value;
+				source.set |= FIELD_SPEED;
+			} else if (key == "attack") {
+				source.stats.attack = value;
+				source.set |= FIELD_ATTACK;
+			} else if (key == "resists") {
+				source.stats.resists = uint32_t(value);
+				source.set |= FIELD_RESISTS;
+			}
+		}
+
+		source.stats.nameHash = hashName(source.name.data(), source.name.size());
+		sources.push_back(source);
+	}
+
+	// 親は名前から引くので、先に索引を作っておく（同じ名前が２つあれば失敗）
+	NameIndex byName;
+	byName.reserve(sources.size());
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (!byName.insert(NameIndex::value_type(sources[i].name, i)).second) return false;
+	}
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (!resolve(sources, byName, i)) return false;
+	}
+
+	unmap();
+	owned_.clear();
+	for (size_t i = 0; i < sources.size(); i++) {
+		owned_.push_back(sources[i].stats);
+	}
+	std::sort(owned_.begin(), owned_.end(),
+		[](const MonsterStats& a, const MonsterStats& b) { return a.nameHash < b.nameHash; });
+
+	// 名前のハッシュが衝突していたら名前を変えてもらう
+	for (size_t i = 1; i < owned_.size(); i++) {
+		if (owned_[i].nameHash == owned_[i - 1].nameHash) return false;
+	}
+
+	records_ = owned_.data();
+	count_ = owned_.size();
+	return true;
+}
+
+// 親を先に解決し、子が明示していないフィールドを親からコピーする
+bool ArchetypeRegistry::resolve(std::vector<Source>& sources, const NameIndex& byName, size_t index) {
+	Source& source = sources[index];
+	if (source.state == 2) return true;
+	if (source.state == 1) return false;	// 継承が循環している
+	if (source.parent.empty()) {
+		source.state = 2;
+		return true;
+	}
+
+	NameIndex::const_iterator found = byName.find(source.parent);
+	if (found == byName.end()) return false;	// 親が見つからない
+
+	source.state = 1;
+	if (!resolve(sources, byName, found->second)) return false;
+
+	const MonsterStats& parent = sources[found->second].stats;
+	if (!(source.set & FIELD_HEALTH))  source.stats.health = parent.health;
+	if (!(source.set & FIELD_SPEED))   source.stats.speed = parent.speed;
+	if (!(source.set & FIELD_ATTACK))  source.stats.attack = parent.attack;
+	if (!(source.set & FIELD_RESISTS)) source.stats.resists = parent.resists;
+	source.state = 2;
+	return true;
+}
+
+bool ArchetypeRegistry::saveBinary(const char* path) const {
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+
+	Header header = { MAGIC, VERSION, uint32_t(count_), uint32_t(sizeof(MonsterStats)) };
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(records_, sizeof(MonsterStats), count_, file) == count_;
+	return fclose(file) == 0 && ok;
+}
+
+// ファイルをそのままマップし、レコードの配列として使う
+bool ArchetypeRegistry::mapBinary(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+
+	void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+
+	// find()は二分探索なので、ファイルを信じずに並びも確かめる
+	//	- ヘッダの後ろがちょうどcount個のレコードであること
+	//	- nameHashが狭義の昇順であること（重複もない）
+	const Header* header = static_cast<const Header*>(mapping);
+	const MonsterStats* records = reinterpret_cast<const MonsterStats*>(header + 1);
+	size_t payload = size_t(st.st_size) - sizeof(Header);
+	bool valid = header->magic == MAGIC && header->version == VERSION &&
+		header->recordSize == sizeof(MonsterStats) &&
+		payload % sizeof(MonsterStats) == 0 &&
+		payload / sizeof(MonsterStats) == header->count;
+	for (size_t i = 1; valid && i < header->count; i++) {
+		valid = records[i - 1].nameHash < records[i].nameHash;
+	}
+	if (!valid) {
+		munmap(mapping, st.st_size);
+		return false;
+	}
+
+	unmap();
+	owned_.clear();
+	mapping_ = mapping;
+	mappingSize_ = st.st_size;
+	records_ = records;
+	count_ = header->count;
+	return true;
+}
+
+void ArchetypeRegistry::unmap() {
+	if (mapping_) {
+		munmap(mapping_, mappingSize_);
+		mapping_ = NULL;
+		records_ = NULL;
+		count_ = 0;
+	}
+}
+
+ArchetypeRegistry archetypes;
+archetypes.mapBinary("monsters.arch");
+int wizard = archetypes.find("goblin wizard");
+
+std::vector<MonsterStats> wave;
+archetypes.spawn(wizard, 5000, wave);
+
+
+
+/*
+	5.1.6	状態を共有する複製（コピー・オン・ライト）
+*/
+/*
+	clone()はすべての状態を複製する（deep copy）
+	しかし能力値の表、AIのパラメータ、ドロップ品の表などは、生成後にほとんど変更されない
+	これらはプロトタイプと参照カウント付きのポインタで共有し、
+	最初に書き込むときにだけ、その個体用にコピーする
+*/
+#include <memory>
+
+// 書き込むまではプロトタイプと共有するポインタ
+template <class T>
+class CopyOnWrite {
+public:
+	explicit CopyOnWrite(T* value)
+	: value_(value)
+	{}
+
+	explicit CopyOnWrite(std::shared_ptr<T> value)
+	: value_(std::move(value))
+	{}
+
+	const T& read() const { return *value_; }
+
+	// 共有しない複製。make_sharedなので、本体と参照カウントの確保は１回
+	CopyOnWrite copy() const { return CopyOnWrite(std::make_shared<T>(*value_)); }
+
+	// 他と共有していれば、ここで初めて自分用にコピーする
+	T& write() {
+		if (value_.use_count() > 1) {
+			value_ = std::make_shared<T>(*value_);
+		}
+		return *value_;
+	}
+
+private:
+	std::shared_ptr<T> value_;
+};
+
+struct LootEntry {
+	int itemId;
+	int weight;
+};
+
+// 生成後はほぼ変わらない部分
+struct GhostTraits {
+	int statsTable[32];
+	float aiAggression;
+	float aiSightRange;
+	float aiFleeHealth;
+	std::vector<LootEntry> lootTable;
+};
+
+class SharedGhost : public Monster {
+public:
+	SharedGhost(int health, GhostTraits* traits)
+	: health_(health),
+	  traits_(traits)
+	  {}
+
+	// これまでどおりのclone()。共有部分も含めて全部コピーする
+	virtual Monster* clone() {
+		return new SharedGhost(health_, traits_.copy());
+	}
+
+	// 共有部分はポインタのコピー（参照カウントの増加）だけ
+	Monster* cloneShared() {
+		return new SharedGhost(*this);
+	}
+
+	virtual size_t cloneSize() const { return sizeof(SharedGhost); }
+	virtual void cloneInto(void* place, size_t count) const {
+		SharedGhost* ghosts = static_cast<SharedGhost*>(place);
+		for (size_t i = 0; i < count; i++) {
+			new (&ghosts[i]) SharedGhost(*this);
+		}
+	}
+
+	const GhostTraits& traits() const { return traits_.read(); }
+
+	// 例えば、怒らせた個体だけAIのパラメータを変える
+	void enrage() { traits_.write().aiAggression *= 2.0f; }
+
+private:
+	SharedGhost(int health, const CopyOnWrite<GhostTraits>& traits)
+	: health_(health),
+	  traits_(traits)
+	  {}
+
+	int health_;	// 個体ごとに変わるものは常に個体が持つ
+	CopyOnWrite<GhostTraits> traits_;
+};
+
+/*
+	１万匹を生成したときのメモリと時間の比較
+	確保の回数とバイト数は、COUNT_ALLOCATIONSを1にしてビルドしたときだけ測る（count_allocations.h）
+*/
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+
+#if COUNT_ALLOCATIONS
+#include "count_allocations.h"
+#endif
+
+void benchmarkSharedSpawn() {
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::micro> Microseconds;
+	const size_t count = 10000;
+
+	GhostTraits* traits = new GhostTraits();
+	traits->lootTable.resize(16);
+	SharedGhost prototype(15, traits);
+
+	std::vector<Monster*> deep;
+	std::vector<Monster*> shared;
+	deep.reserve(count);
+	shared.reserve(count);
+
+#if COUNT_ALLOCATIONS
+	size_t allocations0 = allocationCount.load(), bytes0 = allocatedBytes.load();
+#endif
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; i++) deep.push_back(prototype.clone());
+	Clock::time_point middle = Clock::now();
+#if COUNT_ALLOCATIONS
+	size_t allocations1 = allocationCount.load(), bytes1 = allocatedBytes.load();
+#endif
+	for (size_t i = 0; i < count; i++) shared.push_back(prototype.cloneShared());
+	Clock::time_point end = Clock::now();
+
+	printf("clone()       : %8.1f us\n", Microseconds(middle - start).count());
+	printf("cloneShared() : %8.1f us\n", Microseconds(end - middle).count());
+	printf("%.1fx faster\n", Microseconds(middle - start).count() / Microseconds(end - middle).count());
+#if COUNT_ALLOCATIONS
+	printf("clone()       : %zu allocations, %zu bytes\n", allocations1 - allocations0, bytes1 - bytes0);
+	printf("cloneShared() : %zu allocations, %zu bytes\n",
+		allocationCount.load() - allocations1, allocatedBytes.load() - bytes1);
+#endif
+
+	for (size_t i = 0; i < count; i++) {
+		delete deep[i];
+		delete shared[i];
+	}
+}
+
+
+
+/*
+	5.1.7	型を保ったまま生成する
+*/
+/*
+	5.1.3のSpawnerFor<T>はvirtualなSpawnerを継承し、Monster*を返す
+	呼び出し側は具体的な型を失い、生成のたびにvirtual呼び出しとnew Tが発生する
+	型ごとに連続した格納領域を用意し、spawn()はその型のハンドルを返すようにする
+		- 型がコンパイル時にわかっていれば、SpawnerFor<T>を直接呼べば構築はインライン展開される
+		- 型がわからない場合は、これまでどおり基底のSpawnerから呼べばよい
+		  返ってきたハンドルはMonsterRegistryで引く
+*/
+#include <cassert>
+
+// 型ごとの連続した格納領域。ハンドルは添字なので、領域が伸びても無効にならない
+// clear()で世代が変わるので、それより前のハンドルは無効になる
+template <class T>
+struct Handle {
+	uint32_t index;
+	uint32_t generation;
+};
+
+// 型を消したハンドル。動的な経路で使う
+struct MonsterHandle {
+	int type;
+	uint32_t index;
+	uint32_t generation;
+};
+
+// 型を消した格納領域。MonsterRegistryから引くために使う
+class AnyMonsterStore {
+public:
+	virtual ~AnyMonsterStore() {}
+	virtual bool valid(uint32_t index, uint32_t generation) const = 0;
+	virtual Monster& getMonster(uint32_t index) = 0;
+};
+
+template <class T>
+class MonsterStore : public AnyMonsterStore {
+public:
+	MonsterStore()
+	: generation_(0)
+	{}
+
+	template <class... Args>
+	Handle<T> add(Args&&... args) {
+		Handle<T> handle = { uint32_t(monsters_.size()), generation_ };
+		monsters_.emplace_back(std::forward<Args>(args)...);
+		return handle;
+	}
+
+	bool valid(Handle<T> handle) const { return valid(handle.index, handle.generation); }
+
+	T& get(Handle<T> handle) {
+		assert(valid(handle));
+		return monsters_[handle.index];
+	}
+
+	size_t size() const { return monsters_.size(); }
+	void reserve(size_t count) { monsters_.reserve(count); }
+
+	void clear() {
+		monsters_.clear();
+		generation_++;
+	}
+
+	virtual bool valid(uint32_t index, uint32_t generation) const {
+		return generation == generation_ && index < monsters_.size();
+	}
+
+	virtual Monster& getMonster(uint32_t index) { return monsters_[index]; }
+
+private:
+	std::vector<T> monsters_;
+	uint32_t generation_;
+};
+
+inline int nextMonsterTypeId() {
+	static int next = 0;
+	return next++;
+}
+
+template <class T>
+int monsterTypeId() {
+	static const int id = nextMonsterTypeId();
+	return id;
+}
+
+// 型IDからその型の格納領域を引く。動的な経路で受け取ったMonsterHandleはここで解決する
+class MonsterRegistry {
+public:
+	template <class T>
+	void add(MonsterStore<T>& store) {
+		size_t type = size_t(monsterTypeId<T>());
+		if (stores_.size() <= type) stores_.resize(type + 1, NULL);
+		assert(stores_[type] == NULL);
+		stores_[type] = &store;
+	}
+
+	bool valid(MonsterHandle handle) const {
+		return size_t(handle.type) < stores_.size() && stores_[handle.type] &&
+			stores_[handle.type]->valid(handle.index, handle.generation);
+	}
+
+	Monster& get(MonsterHandle handle) {
+		assert(valid(handle));
+		return stores_[handle.type]->getMonster(handle.index);
+	}
+
+private:
+	std::vector<AnyMonsterStore*> stores_;
+};
+
+class Spawner {
+public:
+	virtual ~Spawner() {}
+	virtual MonsterHandle spawnMonster() = 0;
+};
+
+// finalなので、SpawnerFor<T>として呼べばvirtual呼び出しは消える
+template <class T>
+class SpawnerFor final : public Spawner {
+public:
+	SpawnerFor(const T& prototype, MonsterStore<T>& store)
+	: prototype_(prototype),
+	  store_(store)
+	  {}
+
+	Handle<T> spawn() {
+		return store_.add(prototype_);
+	}
+
+	MonsterStore<T>& store() { return store_; }
+
+	virtual MonsterHandle spawnMonster() {
+		Handle<T> typed = spawn();
+		MonsterHandle handle = { monsterTypeId<T>(), typed.index, typed.generation };
+		return handle;
+	}
+
+private:
+	T prototype_;
+	MonsterStore<T>& store_;
+};
+
+MonsterStore<Ghost> ghosts;
+MonsterRegistry monsters;
+monsters.add(ghosts);
+SpawnerFor<Ghost> ghostSpawner(Ghost(15, 3), ghosts);
+Handle<Ghost> ghost = ghostSpawner.spawn();		// 型がわかっている
+Spawner* spawner = &ghostSpawner;
+MonsterHandle monster = spawner->spawnMonster();	// 型がわからない
+Monster& spawned = monsters.get(monster);
+
+/*
+	virtualなSpawnerFor<T>（new T）と型付きの経路の比較
+*/
+template <class T>
+class HeapSpawnerFor : public Spawner {
+public:
+	HeapSpawnerFor(const T& prototype, std::vector<Monster*>& out)
+	: prototype_(prototype),
+	  out_(out)
+	  {}
+
+	virtual MonsterHandle spawnMonster() {
+		out_.push_back(new T(prototype_));
+		MonsterHandle handle = { monsterTypeId<T>(), uint32_t(out_.size() - 1), 0 };
+		return handle;
+	}
+
+private:
+	T prototype_;
+	std::vector<Monster*>& out_;
+};
+
+void benchmarkTypedSpawn(size_t count) {
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::nano> Nanoseconds;
+
+	std::vector<Monster*> heap;
+	heap.reserve(count);
+	HeapSpawnerFor<Ghost> heapSpawner(Ghost(15, 3), heap);
+	Spawner* virtualSpawner = &heapSpawner;
+
+	MonsterStore<Ghost> store;
+	store.reserve(count);
+	SpawnerFor<Ghost> typedSpawner(Ghost(15, 3), store);
+
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; i++) virtualSpawner->spawnMonster();
+	Clock::time_point middle = Clock::now();
+	for (size_t i = 0; i < count; i++) typedSpawner.spawn();
+	Clock::time_point end = Clock::now();
+
+	printf("virtual + new : %.2f ns/monster\n", Nanoseconds(middle - start).count() / count);
+	printf("typed store   : %.2f ns/monster\n", Nanoseconds(end - middle).count() / count);
+
+	for (size_t i = 0; i < heap.size(); i++) {
+		delete heap[i];
+	}
+}
+
+
+
+/*
+	5.1.8	ウェーブを並列に生成する
+*/
+/*
+	レベル開始時や大きな戦闘のきっかけで数万匹を１つのスレッドで生成すると、目に見えて引っかかる
+	生成要求をワーカースレッドに分け、それぞれが自分のアリーナ（5.1.4のMonsterArena）に
+	プロトタイプから複製する。全スレッドが終わった時点（バリア）で、まとめてワールドに公開する
+		- スレッドiは通し番号の連続した範囲[begin, end)を担当する
+		- IDは「最初のID + 通し番号」、公開も範囲の順に行う
+	よって生成順とIDはスレッド数によらず同じになる
+*/
+#include <thread>
+
+struct SpawnedMonster {
+	uint32_t id;
+	Monster* monster;
+};
+
+class MonsterWorld {
+public:
+	MonsterWorld()
+	: nextId_(0),
+	  published_(0)
+	  {}
+
+	~MonsterWorld() {
+		for (size_t i = 0; i < arenas_.size(); i++) {
+			delete arenas_[i];
+		}
+	}
+
+	size_t size() const { return monsters_.size(); }
+	const SpawnedMonster& operator[](size_t i) const { return monsters_[i]; }
+
+	void spawnWave(const Monster& prototype, size_t count, int threadCount) {
+		if (threadCount < 1) threadCount = 1;
+
+		uint32_t firstId = nextId_;
+		size_t firstSlot = monsters_.size();
+		monsters_.resize(firstSlot + count);
+
+		std::vector<MonsterArena*> slices(threadCount);
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threadCount; t++) {
+			size_t begin = count * t / threadCount;
+			size_t end = count * (t + 1) / threadCount;
+			slices[t] = new MonsterArena();
+
+			workers.push_back(std::thread([=, &prototype, &slices] {
+				MonsterArena& arena = *slices[t];
+				prototype.cloneInto(arena.allocate(end - begin, prototype.cloneSize()), end - begin);
+
+				// 各スレッドは自分の範囲の枠にしか書かないので競合しない
+				for (size_t i = begin; i < end; i++) {
+					SpawnedMonster& spawned = monsters_[firstSlot + i];
+					spawned.id = firstId + uint32_t(i);
+					spawned.monster = arena[i - begin];
+				}
+			}));
+		}
+
+		// バリア：全スレッドの完了を待ってから公開する
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+		arenas_.insert(arenas_.end(), slices.begin(), slices.end());
+		nextId_ += uint32_t(count);
+		published_ = monsters_.size();
+	}
+
+	// ゲームスレッドから見えるのは公開済みの分だけ
+	size_t published() const { return published_; }
+
+private:
+	std::vector<SpawnedMonster> monsters_;
+	std::vector<MonsterArena*> arenas_;
+	uint32_t nextId_;
+	size_t published_;
+};
+
+MonsterWorld world;
+Ghost prototype(15, 3);
+world.spawnWave(prototype, 50000, std::thread::hardware_concurrency());
+
+
+
+/*
+	5.1.9	生成の計測
+*/
+/*
+	どのプロトタイプがメモリと時間を使っているのかがわからない
+	プロトタイプごとに次を数える
+		- フレームあたりの生成数（直前のフレームと最大値）
+		- 生きている個体数
+		- 確保したバイト数
+		- clone()／構築にかかった時間
+	カウンタはrelaxedなatomicの加算だけなので、製品版でも有効にしたままにできる
+	時刻の取得は呼び出し１回につき１組で、まとめて生成する経路ではウェーブ全体で１組になる
+*/
+#include <atomic>
+#include <deque>
+
+struct SpawnStats {
+	SpawnStats(const char* name, size_t instanceSize)
+	: name(name),
+	  instanceSize(instanceSize),
+	  spawns(0),
+	  spawnsThisFrame(0),
+	  live(0),
+	  bytes(0),
+	  nanoseconds(0),
+	  lastFrameSpawns(0),
+	  peakFrameSpawns(0)
+	  {}
+
+	const char* name;
+	size_t instanceSize;
+
+	std::atomic<uint64_t> spawns;
+	std::atomic<uint64_t> spawnsThisFrame;
+	std::atomic<int64_t> live;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> nanoseconds;
+
+	// endFrame()でだけ書き換える
+	uint64_t lastFrameSpawns;
+	uint64_t peakFrameSpawns;
+
+	void despawn(size_t count = 1) {
+		live.fetch_sub(int64_t(count), std::memory_order_relaxed);
+	}
+};
+
+// count個の生成を計測する。デストラクタで時間とカウンタを加算する
+// bytesは実際に確保したバイト数。個別にnewするなら count * instanceSize
+class SpawnTimer {
+public:
+	SpawnTimer(SpawnStats& stats, size_t count)
+	: stats_(stats),
+	  count_(count),
+	  bytes_(count * stats.instanceSize),
+	  start_(std::chrono::steady_clock::now())
+	  {}
+
+	SpawnTimer(SpawnStats& stats, size_t count, size_t bytes)
+	: stats_(stats),
+	  count_(count),
+	  bytes_(bytes),
+	  start_(std::chrono::steady_clock::now())
+	  {}
+
+	~SpawnTimer() {
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start_).count();
+		stats_.nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
+		stats_.spawns.fetch_add(count_, std::memory_order_relaxed);
+		stats_.spawnsThisFrame.fetch_add(count_, std::memory_order_relaxed);
+		stats_.live.fetch_add(int64_t(count_), std::memory_order_relaxed);
+		stats_.bytes.fetch_add(bytes_, std::memory_order_relaxed);
+	}
+
+private:
+	SpawnStats& stats_;
+	size_t count_;
+	size_t bytes_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+class SpawnProfiler {
+public:
+	// dequeなので、登録済みのSpawnStatsのアドレスは変わらない
+	SpawnStats& add(const char* name, size_t instanceSize) {
+		stats_.emplace_back(name, instanceSize);
+		return stats_.back();
+	}
+
+	void despawn(SpawnStats& stats, size_t count = 1) { stats.despawn(count); }
+
+	// フレームの最後にゲームスレッドから呼ぶ
+	void endFrame() {
+		for (size_t i = 0; i < stats_.size(); i++) {
+			SpawnStats& stats = stats_[i];
+			stats.lastFrameSpawns = stats.spawnsThisFrame.exchange(0, std::memory_order_relaxed);
+			stats.peakFrameSpawns = std::max(stats.peakFrameSpawns, stats.lastFrameSpawns);
+		}
+	}
+
+	void dumpCsv(FILE* file) const {
+		fprintf(file, "prototype,spawns,last_frame_spawns,peak_frame_spawns,live,bytes,ns_total,ns_per_spawn\n");
+		for (size_t i = 0; i < stats_.size(); i++) {
+			const SpawnStats& s = stats_[i];
+			uint64_t spawns = s.spawns.load(std::memory_order_relaxed);
+			uint64_t ns = s.nanoseconds.load(std::memory_order_relaxed);
+			fprintf(file, "%s,%llu,%llu,%llu,%lld,%llu,%llu,%.1f\n",
+				s.name,
+				(unsigned long long)spawns,
+				(unsigned long long)s.lastFrameSpawns,
+				(unsigned long long)s.peakFrameSpawns,
+				(long long)s.live.load(std::memory_order_relaxed),
+				(unsigned long long)s.bytes.load(std::memory_order_relaxed),
+				(unsigned long long)ns,
+				spawns ? double(ns) / spawns : 0.0);
+		}
+	}
+
+	void dumpJson(FILE* file) const {
+		fprintf(file, "[\n");
+		for (size_t i = 0; i < stats_.size(); i++) {
+			const SpawnStats& s = stats_[i];
+			fprintf(file, "  { \"prototype\": ");
+			writeJsonString(file, s.name);
+			fprintf(file,
+				", \"spawns\": %llu, \"lastFrameSpawns\": %llu, "
+				"\"peakFrameSpawns\": %llu, \"live\": %lld, \"bytes\": %llu, \"nanoseconds\": %llu }%s\n",
+				(unsigned long long)s.spawns.load(std::memory_order_relaxed),
+				(unsigned long long)s.lastFrameSpawns,
+				(unsigned long long)s.peakFrameSpawns,
+				(long long)s.live.load(std::memory_order_relaxed),
+				(unsigned long long)s.bytes.load(std::memory_order_relaxed),
+				(unsigned long long)s.nanoseconds.load(std::memory_order_relaxed),
+				i + 1 < stats_.size() ? "," : "");
+		}
+		fprintf(file, "]\n");
+	}
+
+private:
+	// 名前は任意の文字列なので、'"'と'\\'と制御文字をエスケープする
+	static void writeJsonString(FILE* file, const char* text) {
+		fputc('"', file);
+		for (const char* c = text; *c; c++) {
+			if (*c == '"' || *c == '\\')	fprintf(file, "\\%c", *c);
+			else if (uint8_t(*c) < 0x20)	fprintf(file, "\\u%04x", uint8_t(*c));
+			else							fputc(*c, file);
+		}
+		fputc('"', file);
+	}
+
+	std::deque<SpawnStats> stats_;
+};
+
+/*
+	それぞれの生成クラスに計測を入れる
+	生きている個体数が合うよう、破棄もそれぞれの生成クラスを通す
+*/
+// プロトタイプを複製する生成クラス（5.1.4）
+// outのアリーナは、この生成クラスのウェーブ専用とする
+class ProfiledSpawner {
+public:
+	ProfiledSpawner(Monster* prototype, SpawnStats& stats)
+	: prototype_(prototype),
+	  stats_(stats)
+	  {}
+
+	Monster* spawnMonster() {
+		SpawnTimer timer(stats_, 1);
+		return prototype_->clone();
+	}
+
+	void destroy(Monster* monster) {
+		delete monster;
+		stats_.despawn();
+	}
+
+	// allocate()は前のウェーブを破棄するので、その分を先に引く
+	// アリーナの領域が足りていれば確保は起きないので、広げたときだけバイト数を数える
+	void spawnMonsters(size_t n, MonsterArena& out) {
+		stats_.despawn(out.size());
+		size_t needed = n * prototype_->cloneSize();
+		SpawnTimer timer(stats_, n, needed > out.capacity() ? needed : 0);
+		prototype_->cloneInto(out.allocate(n, prototype_->cloneSize()), n);
+	}
+
+	void clearWave(MonsterArena& out) {
+		stats_.despawn(out.size());
+		out.clear();
+	}
+
+private:
+	Monster* prototype_;
+	SpawnStats& stats_;
+};
+
+// 生成関数へのポインタを持つ生成クラス（5.1.2）
+// 関数からは大きさがわからないので、登録時のinstanceSizeを使う
+class ProfiledCallbackSpawner {
+public:
+	ProfiledCallbackSpawner(SpawnCallback spawn, SpawnStats& stats)
+	: spawn_(spawn),
+	  stats_(stats)
+	  {}
+
+	Monster* spawnMonster() {
+		SpawnTimer timer(stats_, 1);
+		return spawn_();
+	}
+
+	void destroy(Monster* monster) {
+		delete monster;
+		stats_.despawn();
+	}
+
+private:
+	SpawnCallback spawn_;
+	SpawnStats& stats_;
+};
+
+// 型パラメータの生成クラス（5.1.7）
+// 格納領域は、この生成クラスが生成したものだけを入れるとする
+template <class T>
+class ProfiledSpawnerFor {
+public:
+	ProfiledSpawnerFor(SpawnerFor<T>& spawner, SpawnStats& stats)
+	: spawner_(spawner),
+	  stats_(stats)
+	  {}
+
+	Handle<T> spawn() {
+		SpawnTimer timer(stats_, 1);
+		return spawner_.spawn();
+	}
+
+	void clear() {
+		stats_.despawn(spawner_.store().size());
+		spawner_.store().clear();
+	}
+
+private:
+	SpawnerFor<T>& spawner_;
+	SpawnStats& stats_;
+};
+
+SpawnProfiler profiler;
+ProfiledSpawner ghostSpawner(new Ghost(15, 3), profiler.add("ghost", sizeof(Ghost)));
+ProfiledCallbackSpawner ghostCallbackSpawner(spawnGhost, profiler.add("ghost (callback)", sizeof(Ghost)));
+
+Monster* ghost = ghostSpawner.spawnMonster();
+ghostSpawner.destroy(ghost);
+
+// 毎フレーム
+profiler.endFrame();
+
+// 終了時やデバッグコマンドで
+FILE* file = fopen("spawn_profile.csv", "w");
+profiler.dumpCsv(file);
+fclose(file);
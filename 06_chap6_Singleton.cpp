@@ -266,3 +266,1827 @@ Game::instnce().getAudioPlayer().play(LOUD_BANG);
 /*
  * - 他の選択肢として、サービスロケータから取得する方法もある
  */
+
+
+
+/*
+ * 6.5  サービスの登録と起動時の一括初期化
+ *  FileSystem::instance()の各バージョンは、最初のアクセスで遅延初期化するか、static変数を使う
+ *  6.3.3で見たように、ゲーム中に数百msecの初期化が走るのは困る
+ *  Game::instance()のlog()/fileSystem()/audioPlayer()の代わりに、サービスを登録しておき
+ *      - 起動時にすべて初期化する（遅延初期化しない）
+ *      - 依存関係の順に初期化し、依存しないもの同士は並列に初期化する
+ *      - 初期化後のアクセスは分岐なしのポインタ読み出しだけ
+ *      - サービスごとの初期化時間を報告する
+ */
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ServiceRegistry;
+
+class Services
+{
+public:
+    // 初期化が終わっていればnullチェックは要らない
+    static Log&         log()         { return *log_; }
+    static FileSystem&  fileSystem()  { return *fileSystem_; }
+    static AudioPlayer& audioPlayer() { return *audioPlayer_; }
+
+    // 各サービスの生成方法と依存関係を登録する
+    static void registerAll(ServiceRegistry& registry);
+
+private:
+    static Log*         log_;
+    static FileSystem*  fileSystem_;
+    static AudioPlayer* audioPlayer_;
+};
+
+Log*         Services::log_         = NULL;
+FileSystem*  Services::fileSystem_  = NULL;
+AudioPlayer* Services::audioPlayer_ = NULL;
+
+class ServiceRegistry
+{
+public:
+    ServiceRegistry() : initialized_(false) {}
+    ~ServiceRegistry() { shutdown(); }
+
+    // slotにcreate()の結果を入れる。dependsの各サービスが先に初期化される
+    // 登録はinitialize()の前に済ませる
+    template <class T>
+    void add(const char* name, T** slot, std::function<T*()> create,
+             std::vector<const char*> depends = std::vector<const char*>())
+    {
+        assert(!initialized_);
+        Service service;
+        service.name = name;
+        service.depends = depends;
+        service.create = [slot, create]() { *slot = create(); };
+        service.destroy = [slot]() { delete *slot; *slot = NULL; };
+        service.milliseconds = 0.0;
+        services_.push_back(service);
+    }
+
+    // 依存関係を段に分け、同じ段のサービスは並列に初期化する
+    // 初期化済みなら何もしない（２回目で同じサービスを作り直し、shutdown()で二重に破棄しないように）
+    bool initialize()
+    {
+        if (initialized_) return true;
+
+        std::vector<int> level;
+        if (!computeLevels(level)) return false;
+
+        int maxLevel = 0;
+        for (size_t i = 0; i < level.size(); i++) maxLevel = std::max(maxLevel, level[i]);
+
+        for (int l = 0; l <= maxLevel; l++)
+        {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < services_.size(); i++)
+            {
+                if (level[i] != l) continue;
+                order_.push_back(i);
+                threads.push_back(std::thread([this, i]() {
+                    Service& service = services_[i];
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    service.create();
+                    service.milliseconds = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start).count();
+                }));
+            }
+            for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+        }
+        initialized_ = true;
+        return true;
+    }
+
+    // 初期化と逆の順に破棄する。破棄した後はもう一度initialize()できる
+    void shutdown()
+    {
+        for (size_t i = order_.size(); i > 0; i--) services_[order_[i - 1]].destroy();
+        order_.clear();
+        initialized_ = false;
+    }
+
+    void report(FILE* file) const
+    {
+        for (size_t i = 0; i < order_.size(); i++)
+        {
+            const Service& service = services_[order_[i]];
+            fprintf(file, "%-16s %8.2f ms\n", service.name, service.milliseconds);
+        }
+    }
+
+private:
+    struct Service
+    {
+        const char* name;
+        std::vector<const char*> depends;
+        std::function<void()> create;
+        std::function<void()> destroy;
+        double milliseconds;
+    };
+
+    int find(const char* name) const
+    {
+        for (size_t i = 0; i < services_.size(); i++)
+        {
+            if (strcmp(services_[i].name, name) == 0) return int(i);
+        }
+        return -1;
+    }
+
+    // 各サービスの段 = 依存先の段の最大値 + 1。見つからない依存や循環があれば失敗
+    bool computeLevels(std::vector<int>& level) const
+    {
+        level.assign(services_.size(), -1);
+        for (size_t done = 0; done < services_.size(); )
+        {
+            size_t progress = done;
+            for (size_t i = 0; i < services_.size(); i++)
+            {
+                if (level[i] >= 0) continue;
+
+                int l = 0;
+                bool ready = true;
+                for (size_t d = 0; d < services_[i].depends.size(); d++)
+                {
+                    int dep = find(services_[i].depends[d]);
+                    if (dep < 0)
+                    {
+                        fprintf(stderr, "service %s: unknown dependency %s\n",
+                                services_[i].name, services_[i].depends[d]);
+                        return false;
+                    }
+                    if (level[dep] < 0) { ready = false; break; }
+                    l = std::max(l, level[dep] + 1);
+                }
+                if (ready)
+                {
+                    level[i] = l;
+                    done++;
+                }
+            }
+            if (done == progress)
+            {
+                fprintf(stderr, "service dependency cycle\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<Service> services_;
+    std::vector<size_t> order_;
+    bool initialized_;
+};
+
+void Services::registerAll(ServiceRegistry& registry)
+{
+    registry.add<Log>("log", &log_, []() { return new Log(); });
+    registry.add<FileSystem>("fileSystem", &fileSystem_,
+                             []() { return new LinuxFileSystem(); }, { "log" });
+    registry.add<AudioPlayer>("audioPlayer", &audioPlayer_,
+                              []() { return new AudioPlayer(); }, { "log" });
+}
+
+/*
+ * main()の最初で登録と初期化を済ませる
+ */
+ServiceRegistry registry;
+Services::registerAll(registry);
+registry.initialize();
+registry.report(stdout);
+
+Services::audioPlayer().play(LOUD_BANG);
+
+
+
+/*
+ * 6.6  非同期・一括のファイル読み書き
+ *  FileSystemはブロックするread()/write()しか持たず、read()が返すバッファを誰が解放するのかもわからない
+ *  アセットのロードでメインスレッドが止まってしまう
+ *      - 要求はまとめて（バッチで）投入する
+ *      - データは呼び出し側が渡したバッファ（またはBufferPoolから借りたバッファ）に直接入る。余計なコピーはない
+ *      - 完了はコールバックで受け取る。コールバックはpoll()/wait()を呼んだスレッドで実行される
+ *      - 実装はスレッドプール。createAsyncFileSystem()を通して作る
+ */
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct IoRequest
+{
+    enum Op
+    {
+        OP_READ,
+        OP_WRITE,
+    };
+
+    Op          op;
+    const char* path;
+    int         fd;         // 0以上なら開いてあるfdを使い、pathは見ない。-1ならpathを開いて閉じる
+    char*       buffer;     // 呼び出し側が所有する。完了までは触らない
+    size_t      size;
+    off_t       offset;
+
+    // 読み書きしたバイト数、失敗なら-errno
+    std::function<void(ssize_t result)> done;
+};
+
+class AsyncFileSystem
+{
+public:
+    virtual ~AsyncFileSystem() {}
+
+    // 要求をまとめて投入する。requestsの中身はコピーされるので、呼び出し後に捨ててよい
+    virtual void submit(const IoRequest* requests, size_t count) = 0;
+
+    // 完了した要求のコールバックを呼ぶ。ブロックしない。毎フレーム呼ぶ
+    virtual void poll() = 0;
+
+    // 完了が１つ以上届くまで眠ってからpoll()する。未完了の要求がなければすぐ戻る
+    virtual void wait() = 0;
+
+    // 未完了の要求がなくなるまでwait()する
+    virtual void drain() = 0;
+};
+
+/*
+ * コールバックの代わりにfutureで受け取りたいとき
+ *  promiseもコールバックの中で満たされるので、poll()/wait()/drain()を呼ばない限りfutureは完了しない
+ *  readAsync(...).get() とだけ書くとデッドロックする。その場で待つならawaitResult()を使う
+ */
+inline std::future<ssize_t> readAsync(AsyncFileSystem& files, const char* path,
+                                      char* buffer, size_t size, off_t offset = 0)
+{
+    std::shared_ptr<std::promise<ssize_t> > promise(new std::promise<ssize_t>());
+    IoRequest request = { IoRequest::OP_READ, path, -1, buffer, size, offset,
+                          [promise](ssize_t result) { promise->set_value(result); } };
+    files.submit(&request, 1);
+    return promise->get_future();
+}
+
+// 完了を待ちながらfilesを回し、結果を返す
+inline ssize_t awaitResult(AsyncFileSystem& files, std::future<ssize_t>& result)
+{
+    while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) files.wait();
+    return result.get();
+}
+
+// 同じ大きさのバッファを使い回す
+class BufferPool
+{
+public:
+    BufferPool(size_t bufferSize, size_t count)
+    : bufferSize_(bufferSize), storage_(new char[bufferSize * count])
+    {
+        for (size_t i = 0; i < count; i++) free_.push_back(storage_.get() + i * bufferSize);
+    }
+
+    size_t bufferSize() const { return bufferSize_; }
+
+    char* acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) return NULL;
+        char* buffer = free_.back();
+        free_.pop_back();
+        return buffer;
+    }
+
+    void release(char* buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(buffer);
+    }
+
+private:
+    size_t bufferSize_;
+    std::unique_ptr<char[]> storage_;
+    std::vector<char*> free_;
+    std::mutex mutex_;
+};
+
+namespace {
+
+ssize_t performBlocking(const IoRequest& request)
+{
+    int fd = request.fd;
+    if (fd < 0)
+    {
+        fd = request.op == IoRequest::OP_READ
+           ? open(request.path, O_RDONLY)
+           : open(request.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -errno;
+    }
+
+    ssize_t result = request.op == IoRequest::OP_READ
+                   ? pread(fd, request.buffer, request.size, request.offset)
+                   : pwrite(fd, request.buffer, request.size, request.offset);
+    if (result < 0) result = -errno;
+    if (request.fd < 0) close(fd);
+    return result;
+}
+
+}
+
+/*
+ * スレッドプール版：ワーカーがブロックするopen/pread/closeを行う（fdが渡されたときはpreadだけ）
+ */
+class ThreadPoolFileSystem : public AsyncFileSystem
+{
+public:
+    explicit ThreadPoolFileSystem(int threadCount)
+    : inFlight_(0), quit_(false)
+    {
+        for (int i = 0; i < threadCount; i++)
+        {
+            workers_.push_back(std::thread(&ThreadPoolFileSystem::workerLoop, this));
+        }
+    }
+
+    // 投入済みの要求はすべて終わらせ、コールバックも呼んでから止める
+    // （捨てるとBufferPoolのバッファが戻らず、readAsyncのfutureも完了しない）
+    virtual ~ThreadPoolFileSystem()
+    {
+        drain();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        wake_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+    }
+
+    virtual void submit(const IoRequest* requests, size_t count)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.insert(pending_.end(), requests, requests + count);
+            inFlight_ += count;
+        }
+        wake_.notify_all();
+    }
+
+    virtual void poll()
+    {
+        std::deque<Completion> completed;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            completed.swap(completed_);
+        }
+        for (size_t i = 0; i < completed.size(); i++)
+        {
+            completed[i].request.done(completed[i].result);
+        }
+        inFlight_ -= completed.size();
+    }
+
+    virtual void wait()
+    {
+        if (inFlight_ == 0) return;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            finished_.wait(lock, [this] { return !completed_.empty(); });
+        }
+        poll();
+    }
+
+    virtual void drain()
+    {
+        while (inFlight_ > 0) wait();
+    }
+
+private:
+    struct Completion
+    {
+        IoRequest request;
+        ssize_t   result;
+    };
+
+    void workerLoop()
+    {
+        for (;;)
+        {
+            IoRequest request;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return quit_ || !pending_.empty(); });
+                if (quit_) return;
+                request = pending_.front();
+                pending_.pop_front();
+            }
+
+            Completion completion = { request, performBlocking(request) };
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                completed_.push_back(completion);
+            }
+            finished_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<IoRequest> pending_;
+    std::deque<Completion> completed_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable finished_;
+    std::atomic<size_t> inFlight_;
+    bool quit_;
+};
+
+/*
+ * 使う側はこれを通して作る。ここ以外は具体的な実装を知らない
+ * io_uringなどの別の実装を足すときは、ここで初期化を試し、失敗したらスレッドプールに戻す
+ */
+std::unique_ptr<AsyncFileSystem> createAsyncFileSystem(int threadCount)
+{
+    return std::unique_ptr<AsyncFileSystem>(new ThreadPoolFileSystem(threadCount));
+}
+
+/*
+ * スループットの計測
+ *  - 小さなファイルを大量に読む
+ *  - 大きなファイルをchunkSizeずつストリーミングで読む（キューには常にdepth個の要求を入れておく）
+ *    ファイルは最初に１回だけ開き、各チャンクはそのfdから読む
+ *  バッファが尽きたらwait()で眠る（poll()で回り続けない）
+ */
+void benchmarkSmallFiles(AsyncFileSystem& files, const std::vector<std::string>& paths, BufferPool& pool)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    size_t bytes = 0;
+    size_t inFlight = 0;
+    std::vector<IoRequest> batch;
+    for (size_t i = 0; i < paths.size(); )
+    {
+        batch.clear();
+        for (char* buffer; i < paths.size() && (buffer = pool.acquire()) != NULL; i++)
+        {
+            IoRequest request = { IoRequest::OP_READ, paths[i].c_str(), -1, buffer, pool.bufferSize(), 0,
+                                  [&pool, &bytes, &inFlight, buffer](ssize_t result) {
+                                      if (result > 0) bytes += result;
+                                      pool.release(buffer);
+                                      inFlight--;
+                                  } };
+            batch.push_back(request);
+        }
+
+        if (batch.empty())
+        {
+            // バッファを持っているのが自分の要求でなければ、待っても戻ってこない
+            if (inFlight == 0)
+            {
+                fprintf(stderr, "benchmarkSmallFiles: no free buffers in the pool\n");
+                return;
+            }
+            files.wait();
+            continue;
+        }
+
+        files.submit(batch.data(), batch.size());
+        inFlight += batch.size();
+        files.wait();
+    }
+    files.drain();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("small files: %zu files, %.0f files/s, %.1f MB/s\n",
+           paths.size(), paths.size() / seconds, bytes / seconds / 1e6);
+}
+
+void benchmarkStreaming(AsyncFileSystem& files, const char* path, size_t fileSize,
+                        size_t chunkSize, int depth)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+
+    std::vector<char> buffers(chunkSize * depth);
+    std::vector<int> freeBuffers;
+    for (int i = 0; i < depth; i++) freeBuffers.push_back(i);
+
+    size_t bytes = 0;
+    for (off_t offset = 0; offset < off_t(fileSize); )
+    {
+        while (!freeBuffers.empty() && offset < off_t(fileSize))
+        {
+            int index = freeBuffers.back();
+            freeBuffers.pop_back();
+            IoRequest request = { IoRequest::OP_READ, path, fd, &buffers[index * chunkSize], chunkSize, offset,
+                                  [&bytes, &freeBuffers, index](ssize_t result) {
+                                      if (result > 0) bytes += result;
+                                      freeBuffers.push_back(index);
+                                  } };
+            files.submit(&request, 1);
+            offset += chunkSize;
+        }
+        files.wait();
+    }
+    files.drain();
+    close(fd);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("streaming: %zu bytes in %zu KB chunks, %.1f MB/s\n",
+           bytes, chunkSize / 1024, bytes / seconds / 1e6);
+}
+
+
+
+/*
+ * 6.7  アーカイブをmmapするFileSystem
+ *  PS4FileSystem/WiiFileSystemは中身が空で、read()のたびにファイルを開いて新しいバッファにコピーすることになる
+ *  製品版では、すべてのアセットを１つのアーカイブファイルにまとめておく
+ *      - 先頭に目次（パスのハッシュでソート済み）を置き、二分探索で引く
+ *      - アーカイブは起動時に１回だけmmapする
+ *      - read()はマップした領域を直接指すポインタを返す（コピーなし、解放不要、書き込み禁止）
+ *  アーカイブはオフラインのツール（packArchive）で作る
+ *
+ *  レイアウト
+ *      ArchiveHeader
+ *      ArchiveEntry[count]     hashの昇順
+ *      パス文字列              衝突したときの照合用
+ *      データ                  各ファイルの後ろに'\0'を付け、16バイト境界に揃える
+ */
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct ArchiveHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+};
+
+struct ArchiveEntry
+{
+    uint64_t hash;
+    uint64_t offset;        // アーカイブ先頭からのデータの位置
+    uint64_t size;          // 末尾の'\0'は含まない
+    uint64_t pathOffset;
+    uint64_t pathLength;
+};
+
+static const uint32_t ARCHIVE_MAGIC = 0x4b434150;   // "PACK"
+static const uint32_t ARCHIVE_VERSION = 1;
+
+inline uint64_t hashPath(const char* path, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;        // FNV-1a
+    for (size_t i = 0; i < length; i++) hash = (hash ^ uint8_t(path[i])) * 1099511628211ull;
+    return hash;
+}
+
+struct FileView
+{
+    const char* data;
+    size_t      size;
+};
+
+class ArchiveFileSystem : public FileSystem
+{
+public:
+    ArchiveFileSystem()
+    : base_(NULL), size_(0), entries_(NULL), count_(0)
+    {}
+
+    virtual ~ArchiveFileSystem()
+    {
+        if (base_) munmap(base_, size_);
+    }
+
+    bool open(const char* archivePath)
+    {
+        int fd = ::open(archivePath, O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ArchiveHeader))
+        {
+            close(fd);
+            return false;
+        }
+
+        void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+
+        if (!validate(static_cast<const char*>(base), st.st_size))
+        {
+            munmap(base, st.st_size);
+            return false;
+        }
+
+        // 開き直した場合は前のマップを捨てる
+        if (base_) munmap(base_, size_);
+
+        const ArchiveHeader* header = static_cast<const ArchiveHeader*>(base);
+        base_ = static_cast<char*>(base);
+        size_ = st.st_size;
+        entries_ = reinterpret_cast<const ArchiveEntry*>(header + 1);
+        count_ = header->count;
+        return true;
+    }
+
+    // 見つからなければdataはNULL
+    FileView view(const char* path) const
+    {
+        size_t length = strlen(path);
+        uint64_t hash = hashPath(path, length);
+
+        const ArchiveEntry* end = entries_ + count_;
+        const ArchiveEntry* entry = std::lower_bound(entries_, end, hash,
+            [](const ArchiveEntry& e, uint64_t h) { return e.hash < h; });
+
+        for (; entry != end && entry->hash == hash; entry++)
+        {
+            if (entry->pathLength == length &&
+                memcmp(base_ + entry->pathOffset, path, length) == 0)
+            {
+                FileView view = { base_ + entry->offset, size_t(entry->size) };
+                return view;
+            }
+        }
+
+        FileView missing = { NULL, 0 };
+        return missing;
+    }
+
+    // マップした領域をそのまま返す。'\0'終端済み。解放も書き込みもしないこと
+    virtual char* read(char* path)
+    {
+        return const_cast<char*>(view(path).data);
+    }
+
+    // アーカイブは読み込み専用。書き込みは行わず、リリースビルドでも黙って捨てずに報告する
+    virtual void write(char* path, char* text)
+    {
+        fprintf(stderr, "ArchiveFileSystem: cannot write %s, the archive is read-only\n", path);
+        assert(false);
+    }
+
+private:
+    /*
+     * 目次は開くときに１回だけ検査する。これを通ればview()は境界チェックなしで引ける
+     *  - countは掛け算せずに割り算で上限と比べる（オーバーフロー対策）
+     *  - 各エントリのデータ（末尾の'\0'込み）とパス文字列がファイル内に収まること
+     *  - lower_boundのためにhashが昇順であること
+     */
+    static bool validate(const char* base, size_t size)
+    {
+        const ArchiveHeader* header = reinterpret_cast<const ArchiveHeader*>(base);
+        if (header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION) return false;
+        if (header->count > (size - sizeof(ArchiveHeader)) / sizeof(ArchiveEntry)) return false;
+
+        const ArchiveEntry* entries = reinterpret_cast<const ArchiveEntry*>(header + 1);
+        for (uint64_t i = 0; i < header->count; i++)
+        {
+            const ArchiveEntry& entry = entries[i];
+            if (entry.offset > size || entry.size >= size - entry.offset) return false;
+            if (base[entry.offset + entry.size] != '\0') return false;
+            if (entry.pathOffset > size || entry.pathLength > size - entry.pathOffset) return false;
+            if (i > 0 && entries[i - 1].hash > entry.hash) return false;
+        }
+        return true;
+    }
+
+    char*               base_;
+    size_t              size_;
+    const ArchiveEntry* entries_;
+    size_t              count_;
+};
+
+/*
+ * オフラインのパッカー
+ *  filesの各ファイルを読み、archivePathに書き出す。namesはアーカイブ内でのパス
+ */
+bool packArchive(const char* archivePath,
+                 const std::vector<std::string>& files,
+                 const std::vector<std::string>& names)
+{
+    const size_t ALIGNMENT = 16;
+    size_t count = files.size();
+    if (names.size() != count) return false;
+
+    // 同じパスが２つあるとview()でどちらが返るか決まらない
+    std::vector<std::string> sorted(names);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) return false;
+
+    std::vector<ArchiveEntry> entries(count);
+    std::vector<size_t> order(count);
+
+    // 目次、パス文字列、データの順に並べるので、先にパス文字列の位置を決める
+    uint64_t position = sizeof(ArchiveHeader) + count * sizeof(ArchiveEntry);
+    for (size_t i = 0; i < count; i++)
+    {
+        entries[i].hash = hashPath(names[i].data(), names[i].size());
+        entries[i].pathOffset = position;
+        entries[i].pathLength = names[i].size();
+        position += names[i].size();
+        order[i] = i;
+    }
+
+    std::vector<char> data;
+    position = (position + ALIGNMENT - 1) & ~uint64_t(ALIGNMENT - 1);
+    uint64_t dataStart = position;
+    for (size_t i = 0; i < count; i++)
+    {
+        FILE* file = fopen(files[i].c_str(), "rb");
+        if (!file) return false;
+
+        size_t begin = data.size();
+        char chunk[64 * 1024];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) data.insert(data.end(), chunk, chunk + read);
+        fclose(file);
+
+        entries[i].offset = dataStart + begin;
+        entries[i].size = data.size() - begin;
+        data.push_back('\0');
+        data.resize((data.size() + ALIGNMENT - 1) & ~(ALIGNMENT - 1), '\0');
+    }
+
+    std::sort(order.begin(), order.end(),
+              [&entries](size_t a, size_t b) { return entries[a].hash < entries[b].hash; });
+
+    FILE* out = fopen(archivePath, "wb");
+    if (!out) return false;
+
+    ArchiveHeader header = { ARCHIVE_MAGIC, ARCHIVE_VERSION, count };
+    fwrite(&header, sizeof(header), 1, out);
+    for (size_t i = 0; i < count; i++) fwrite(&entries[order[i]], sizeof(ArchiveEntry), 1, out);
+    for (size_t i = 0; i < count; i++) fwrite(names[i].data(), 1, names[i].size(), out);
+
+    static const char padding[ALIGNMENT] = {};
+    long written = ftell(out);
+    fwrite(padding, 1, dataStart - written, out);
+    fwrite(data.data(), 1, data.size(), out);
+
+    return fclose(out) == 0;
+}
+
+#if BUILD_PACKER
+// pack <archive> <file>...  アーカイブ内のパスは引数のパスそのまま
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <archive> <file>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> files(argv + 2, argv + argc);
+    if (!packArchive(argv[1], files, files))
+    {
+        fprintf(stderr, "failed to write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * 小さなアセットを大量に読む場合の比較
+ *  loose   : open + fstat + read + close、毎回バッファを確保
+ *  archive : 目次の二分探索だけ
+ *  どちらも全バイトのチェックサムを取り、同じ量のデータに触れる
+ */
+void benchmarkArchive(const char* archivePath, const std::vector<std::string>& paths)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point start = Clock::now();
+    size_t looseBytes = 0;
+    unsigned looseChecksum = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        int fd = ::open(paths[i].c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        struct stat st;
+        fstat(fd, &st);
+        char* buffer = new char[st.st_size + 1];
+        ssize_t read = ::read(fd, buffer, st.st_size);
+        close(fd);
+        if (read > 0) looseBytes += read;
+        for (ssize_t j = 0; j < read; j++) looseChecksum += uint8_t(buffer[j]);
+        delete[] buffer;
+    }
+    Clock::time_point middle = Clock::now();
+
+    ArchiveFileSystem archive;
+    if (!archive.open(archivePath)) return;
+    size_t archiveBytes = 0;
+    unsigned checksum = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        FileView view = archive.view(paths[i].c_str());
+        if (!view.data) continue;
+        archiveBytes += view.size;
+        for (size_t j = 0; j < view.size; j++) checksum += uint8_t(view.data[j]);
+    }
+    Clock::time_point end = Clock::now();
+
+    typedef std::chrono::duration<double, std::micro> Microseconds;
+    printf("loose  : %zu files, %zu bytes, %.2f us/file (checksum %u)\n",
+           paths.size(), looseBytes, Microseconds(middle - start).count() / paths.size(), looseChecksum);
+    printf("archive: %zu files, %zu bytes, %.2f us/file (checksum %u)\n",
+           paths.size(), archiveBytes, Microseconds(end - middle).count() / paths.size(), checksum);
+}
+
+
+
+/*
+ * 6.8  ロックを取らないLog
+ *  6.3.2のLog::instance().write("Some event.")は、どのモジュールからも、どのスレッドからも呼ばれる
+ *  6.3.1で見たように、こういうグローバルなオブジェクトはスレッド間の競合の元になる
+ *      - write()は固定長のバイナリレコード（時刻、書式、引数）を自スレッドのリングバッファに置くだけ
+ *        ロックも確保もしない。書式化はしない
+ *      - バックグラウンドのスレッドが全スレッドのバッファを読み出して書式化し、ファイルに書く
+ *      - バッファが一杯のときは、捨てる（LOG_FULL_DROP）か空くまで待つ（LOG_FULL_BLOCK）かを選べる
+ *  書式は文字列リテラルのポインタをそのままIDとして使う。書式指定は%d/%u/%x/%f/%s（整数は幅を問わない）
+ *  %sに渡せるのはリテラルなど、ずっと生きている文字列だけ
+ */
+#include <cinttypes>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+// alignasで64バイトに揃えた型は、C++17より前のnewでは揃うとは限らないので、揃えて確保する
+template <class T>
+T* newAligned()
+{
+    void* memory = NULL;
+    if (posix_memalign(&memory, alignof(T), sizeof(T)) != 0) throw std::bad_alloc();
+    return new (memory) T();
+}
+
+template <class T>
+void deleteAligned(T* p)
+{
+    if (!p) return;
+    p->~T();
+    free(p);
+}
+
+class Log
+{
+public:
+    enum FullPolicy
+    {
+        LOG_FULL_DROP,
+        LOG_FULL_BLOCK,
+    };
+
+    static const size_t BUFFER_RECORDS = 4096;      // スレッドごと。2の冪
+    static const int    MAX_ARGS = 5;
+    static const int    THREAD_CACHE = 4;           // スレッドごとに覚えておくLogの数
+
+    Log(FILE* out, FullPolicy policy)
+    : id_(nextId()), out_(out), policy_(policy), quit_(false), dropped_(0),
+      writer_(&Log::writerLoop, this)
+    {}
+
+    ~Log()
+    {
+        quit_.store(true, std::memory_order_release);
+        writer_.join();
+        for (size_t i = 0; i < buffers_.size(); i++) deleteAligned(buffers_[i]);
+    }
+
+    // スレッドの開始時に呼んでおけば、最初のwrite()でも確保が起きない
+    // １つのスレッドから使うLogがTHREAD_CACHE個までなら、以降のwrite()はロックも確保もしない
+    void attachThread() { buffer(); }
+
+    template <class... Args>
+    void write(const char* format, Args... args)
+    {
+        static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+
+        ThreadBuffer& ring = buffer();
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        while (head - ring.tail.load(std::memory_order_acquire) >= BUFFER_RECORDS)
+        {
+            if (policy_ == LOG_FULL_DROP)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        Record& record = ring.records[head & (BUFFER_RECORDS - 1)];
+        record.timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        record.format = format;
+        record.argCount = sizeof...(Args);
+        pack(record, 0, args...);
+
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    enum ArgType
+    {
+        ARG_INT,
+        ARG_UINT,
+        ARG_DOUBLE,
+        ARG_STRING,
+    };
+
+    struct Arg
+    {
+        union
+        {
+            int64_t     i;
+            uint64_t    u;
+            double      d;
+            const char* s;
+        };
+    };
+
+    // 64バイトの固定長レコード
+    struct Record
+    {
+        int64_t     timestamp;
+        const char* format;
+        uint8_t     argCount;
+        uint8_t     types[MAX_ARGS];
+        Arg         args[MAX_ARGS];
+    };
+    static_assert(sizeof(Record) == 64, "log record should fill one cache line");
+
+    // １つのスレッドが書き、ライタースレッドが読む（SPSC）
+    struct ThreadBuffer
+    {
+        ThreadBuffer() : head(0), tail(0) {}
+
+        std::thread::id owner;
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) Record records[BUFFER_RECORDS];
+    };
+
+    static void pack(Record&, int) {}
+
+    template <class T, class... Rest>
+    static void pack(Record& record, int index, T value, Rest... rest)
+    {
+        set(record, index, value);
+        pack(record, index + 1, rest...);
+    }
+
+    // char*もconst char*に、floatもdoubleに変換してここへ来る
+    static void set(Record& r, int i, const char* s) { r.types[i] = ARG_STRING; r.args[i].s = s; }
+    static void set(Record& r, int i, double d)      { r.types[i] = ARG_DOUBLE; r.args[i].d = d; }
+
+    template <class T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    set(Record& r, int i, T value)
+    {
+        if (std::is_signed<T>::value) { r.types[i] = ARG_INT;  r.args[i].i = int64_t(value); }
+        else                          { r.types[i] = ARG_UINT; r.args[i].u = uint64_t(value); }
+    }
+
+    static uint64_t nextId()
+    {
+        static std::atomic<uint64_t> next(1);
+        return next.fetch_add(1);
+    }
+
+    // スレッドごとに、最近使ったTHREAD_CACHE個のLogのバッファを覚えておく
+    // Logを作り直しても古いバッファを指さないよう、アドレスではなくIDで照合する
+    ThreadBuffer& buffer()
+    {
+        CachedBuffer* cache = threadCache();
+        for (int i = 0; i < THREAD_CACHE; i++)
+        {
+            if (cache[i].log == id_) return *cache[i].ring;
+        }
+        return attach(cache);
+    }
+
+    struct CachedBuffer
+    {
+        uint64_t      log;
+        ThreadBuffer* ring;
+    };
+
+    static CachedBuffer* threadCache()
+    {
+        static thread_local CachedBuffer cache[THREAD_CACHE] = {};
+        return cache;
+    }
+
+    // キャッシュから追い出されたLogに戻ってきたときは、以前のバッファを探して使う
+    // バッファは (スレッド, Log) ごとに１つなので、何度切り替えても増えない
+    ThreadBuffer& attach(CachedBuffer* cache)
+    {
+        static thread_local int victim = 0;
+        std::thread::id self = std::this_thread::get_id();
+        ThreadBuffer* ring = NULL;
+        {
+            std::lock_guard<std::mutex> lock(buffersMutex_);
+            for (size_t i = 0; i < buffers_.size() && !ring; i++)
+            {
+                if (buffers_[i]->owner == self) ring = buffers_[i];
+            }
+            if (!ring)
+            {
+                ring = newAligned<ThreadBuffer>();
+                ring->owner = self;
+                buffers_.push_back(ring);
+            }
+        }
+
+        CachedBuffer& entry = cache[victim];
+        victim = (victim + 1) % THREAD_CACHE;
+        entry.log = id_;
+        entry.ring = ring;
+        return *ring;
+    }
+
+    // 書式の各変換指定を、引数の型に合わせた長さ修飾子に置き換えてsnprintfする
+    void formatRecord(const Record& record)
+    {
+        char line[512];
+        int length = snprintf(line, sizeof(line), "[%" PRId64 "] ", record.timestamp);
+        int arg = 0;
+
+        for (const char* p = record.format; *p && length < int(sizeof(line)) - 1; p++)
+        {
+            if (*p != '%' || p[1] == '%' || arg >= record.argCount)
+            {
+                line[length++] = *p;
+                if (*p == '%' && p[1] == '%') p++;
+                continue;
+            }
+
+            // %の後ろ、変換文字までを取り出す（長さ修飾子は捨てる）
+            char spec[16] = "%";
+            int specLength = 1;
+            for (p++; *p && strchr("-+ #0123456789.", *p) && specLength < 8; p++) spec[specLength++] = *p;
+            while (*p && strchr("hljztL", *p)) p++;
+            if (!*p) break;
+
+            char conversion = *p;
+            const Arg& value = record.args[arg];
+            size_t room = sizeof(line) - length;
+            switch (record.types[arg++])
+            {
+                case ARG_STRING:
+                    spec[specLength++] = 's';
+                    length += snprintf(line + length, room, spec, value.s);
+                    break;
+                case ARG_DOUBLE:
+                    spec[specLength++] = strchr("eEgGaA", conversion) ? conversion : 'f';
+                    length += snprintf(line + length, room, spec, value.d);
+                    break;
+                case ARG_INT:
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = conversion == 'x' || conversion == 'X' ? conversion : 'd';
+                    length += snprintf(line + length, room, spec, (long long)value.i);
+                    break;
+                case ARG_UINT:
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = conversion == 'x' || conversion == 'X' ? conversion : 'u';
+                    length += snprintf(line + length, room, spec, (unsigned long long)value.u);
+                    break;
+            }
+            if (length > int(sizeof(line)) - 1) length = sizeof(line) - 1;
+        }
+
+        line[length++] = '\n';
+        fwrite(line, 1, length, out_);
+    }
+
+    // 全スレッドのバッファを読み出す。何もなければ少し眠る
+    void writerLoop()
+    {
+        for (;;)
+        {
+            bool quit = quit_.load(std::memory_order_acquire);
+            size_t drained = 0;
+
+            std::vector<ThreadBuffer*> buffers;
+            {
+                std::lock_guard<std::mutex> lock(buffersMutex_);
+                buffers = buffers_;
+            }
+
+            for (size_t b = 0; b < buffers.size(); b++)
+            {
+                ThreadBuffer& ring = *buffers[b];
+                uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+                uint64_t head = ring.head.load(std::memory_order_acquire);
+                for (; tail != head; tail++, drained++)
+                {
+                    formatRecord(ring.records[tail & (BUFFER_RECORDS - 1)]);
+                }
+                ring.tail.store(tail, std::memory_order_release);
+            }
+
+            if (drained == 0)
+            {
+                if (quit) break;
+                fflush(out_);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped) fprintf(out_, "[log] dropped %" PRIu64 " records\n", dropped);
+        fflush(out_);
+    }
+
+    uint64_t                    id_;
+    FILE*                       out_;
+    FullPolicy                  policy_;
+    std::atomic<bool>           quit_;
+    std::atomic<uint64_t>       dropped_;
+    std::vector<ThreadBuffer*>  buffers_;
+    std::mutex                  buffersMutex_;
+    std::thread                 writer_;
+};
+
+/*
+ * write()の遅延を同期的なfprintfと比べる
+ */
+void benchmarkLog(FILE* out, int count)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<double> fprintfLatency(count);
+    std::vector<double> logLatency(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        Clock::time_point start = Clock::now();
+        fprintf(out, "frame %d: entity %u moved to %f\n", i, 42u, i * 0.5);
+        fprintfLatency[i] = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    {
+        Log log(out, Log::LOG_FULL_BLOCK);
+        log.attachThread();
+        for (int i = 0; i < count; i++)
+        {
+            Clock::time_point start = Clock::now();
+            log.write("frame %d: entity %u moved to %f", i, 42u, i * 0.5);
+            logLatency[i] = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        }
+    }
+
+    std::sort(fprintfLatency.begin(), fprintfLatency.end());
+    std::sort(logLatency.begin(), logLatency.end());
+    printf("fprintf   : p50 %6.0f ns  p99 %6.0f ns  max %8.0f ns\n",
+           fprintfLatency[count / 2], fprintfLatency[count * 99 / 100], fprintfLatency[count - 1]);
+    printf("Log::write: p50 %6.0f ns  p99 %6.0f ns  max %8.0f ns\n",
+           logLatency[count / 2], logLatency[count * 99 / 100], logLatency[count - 1]);
+}
+
+
+
+/*
+ * 6.9  FileSystem::read()の前に置くキャッシュ
+ *  read()は毎回プラットフォームのバックエンドまで行くので、同じ設定ファイルやテクスチャを何度読んでも
+ *  そのたびにストレージに触る
+ *      - 中身をLRUで保持する。上限はバイト数で決める
+ *      - キーはパスのハッシュ（6.7のhashPath）
+ *      - 複数スレッドから読めるよう、キーで分けたシャードごとにロックする
+ *      - プリフェッチのヒントを受け取り、バックグラウンドのスレッドで先に読んでおく
+ *      - ヒット率と、読まずに済んだバイト数を数える
+ *  バックエンドのread()は'\0'終端の文字列をnew[]して返し、呼び出し側がdelete[]する、とする
+ *  テクスチャなどのバイナリは途中の'\0'で切れてしまうので、大きさのわかるLoaderを渡す
+ *  load()はキャッシュの中身を共有で返す（追い出されても、持っている間は有効）
+ *  上限はシャードごとに均等に分ける（budgetBytes / SHARDS）。それより大きいファイルは毎回バックエンドから読む
+ */
+#include <list>
+#include <unordered_map>
+
+// ばらのファイルを、途中に'\0'があってもそのまま読むLoader
+inline bool loadLooseFile(const char* path, std::string& contents)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    contents.clear();
+    char chunk[64 * 1024];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) contents.append(chunk, read);
+    fclose(file);
+    return true;
+}
+
+class CachedFileSystem : public FileSystem
+{
+public:
+    typedef std::shared_ptr<const std::string> Contents;
+
+    // ファイル全体をcontentsに読む。なければfalse
+    typedef std::function<bool(const char* path, std::string& contents)> Loader;
+
+    static const int SHARDS = 16;
+
+    // バックエンドのread()で読む。テキストだけ
+    CachedFileSystem(FileSystem& backend, size_t budgetBytes)
+    : backend_(backend), hits_(0), misses_(0), bytesSaved_(0), tooLarge_(0), quit_(false),
+      prefetcher_(&CachedFileSystem::prefetchLoop, this)
+    {
+        for (int i = 0; i < SHARDS; i++) shards_[i].budget = budgetBytes / SHARDS;
+    }
+
+    // 読むのはloader、書くのはバックエンド
+    CachedFileSystem(FileSystem& backend, Loader loader, size_t budgetBytes)
+    : backend_(backend), loader_(loader), hits_(0), misses_(0), bytesSaved_(0), tooLarge_(0), quit_(false),
+      prefetcher_(&CachedFileSystem::prefetchLoop, this)
+    {
+        for (int i = 0; i < SHARDS; i++) shards_[i].budget = budgetBytes / SHARDS;
+    }
+
+    virtual ~CachedFileSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(prefetchMutex_);
+            quit_ = true;
+        }
+        prefetchWake_.notify_one();
+        prefetcher_.join();
+    }
+
+    // 見つからなければNULL
+    Contents load(const char* path)
+    {
+        uint64_t key = hashPath(path, strlen(path));
+        Shard& shard = shards_[key % SHARDS];
+
+        Contents contents = shard.find(key, path);
+        if (contents)
+        {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            bytesSaved_.fetch_add(contents->size(), std::memory_order_relaxed);
+            return contents;
+        }
+
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return fill(shard, key, path);
+    }
+
+    // これまでのread()と同じ約束：new[]したコピーを返す。バイナリにはload()を使う
+    virtual char* read(char* path)
+    {
+        Contents contents = load(path);
+        if (!contents) return NULL;
+        char* copy = new char[contents->size() + 1];
+        memcpy(copy, contents->c_str(), contents->size() + 1);
+        return copy;
+    }
+
+    // 書き終えてから古い中身を捨て、シャードの版を進める
+    // 書き込みの前から読んでいたload()やプリフェッチは、入れるときに版が違うので入れない
+    virtual void write(char* path, char* text)
+    {
+        backend_.write(path, text);
+        uint64_t key = hashPath(path, strlen(path));
+        shards_[key % SHARDS].invalidate(key);
+    }
+
+    // 近いうちに読むはずのファイル。バックグラウンドで読んでおく
+    void prefetch(const char* path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(prefetchMutex_);
+            prefetchQueue_.push_back(path);
+        }
+        prefetchWake_.notify_one();
+    }
+
+    void report(FILE* file) const
+    {
+        uint64_t hits = hits_.load();
+        uint64_t misses = misses_.load();
+        fprintf(file, "cache: %llu hits, %llu misses, hit rate %.1f%%, %llu bytes saved, %llu too large\n",
+                (unsigned long long)hits, (unsigned long long)misses,
+                hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                (unsigned long long)bytesSaved_.load(), (unsigned long long)tooLarge_.load());
+    }
+
+private:
+    // 新しいものほど前。mapはキーからlistの要素を引く
+    struct Shard
+    {
+        struct Entry
+        {
+            uint64_t key;
+            std::string path;
+            Contents contents;
+        };
+
+        Shard() : budget(0), bytes(0), version(0) {}
+
+        uint64_t currentVersion()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return version;
+        }
+
+        Contents find(uint64_t key, const char* path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found = index.find(key);
+            if (found == index.end() || found->second->path != path) return Contents();
+            lru.splice(lru.begin(), lru, found->second);
+            return found->second->contents;
+        }
+
+        // 読み始めたときのreadVersionから書き込みがあれば、古いかもしれないので入れない
+        void insert(uint64_t key, const char* path, const Contents& contents, uint64_t readVersion)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (version != readVersion) return;
+            if (index.count(key)) return;   // 他のスレッドが先に入れた
+
+            Entry entry = { key, path, contents };
+            lru.push_front(entry);
+            index[key] = lru.begin();
+            bytes += contents->size();
+
+            while (bytes > budget)
+            {
+                Entry& victim = lru.back();
+                bytes -= victim.contents->size();
+                index.erase(victim.key);
+                lru.pop_back();
+            }
+        }
+
+        void invalidate(uint64_t key)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            version++;
+            std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found = index.find(key);
+            if (found == index.end()) return;
+            bytes -= found->second->contents->size();
+            lru.erase(found->second);
+            index.erase(found);
+        }
+
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t budget;
+        size_t bytes;
+        uint64_t version;   // シャードのどれかのファイルに書き込むたびに進む
+    };
+
+    // バックエンドから読んで、入るならキャッシュに入れる
+    Contents fill(Shard& shard, uint64_t key, const char* path)
+    {
+        uint64_t version = shard.currentVersion();
+        Contents contents = readBackend(path);
+        if (!contents) return contents;
+
+        if (contents->size() > shard.budget) tooLarge_.fetch_add(1, std::memory_order_relaxed);
+        else                                 shard.insert(key, path, contents, version);
+        return contents;
+    }
+
+    Contents readBackend(const char* path)
+    {
+        if (loader_)
+        {
+            std::shared_ptr<std::string> contents = std::make_shared<std::string>();
+            if (!loader_(path, *contents)) return Contents();
+            return contents;
+        }
+
+        char* text = backend_.read(const_cast<char*>(path));
+        if (!text) return Contents();
+        Contents contents = std::make_shared<const std::string>(text);
+        delete[] text;
+        return contents;
+    }
+
+    void prefetchLoop()
+    {
+        for (;;)
+        {
+            std::string path;
+            {
+                std::unique_lock<std::mutex> lock(prefetchMutex_);
+                prefetchWake_.wait(lock, [this] { return quit_ || !prefetchQueue_.empty(); });
+                if (quit_) return;
+                path = prefetchQueue_.front();
+                prefetchQueue_.pop_front();
+            }
+
+            uint64_t key = hashPath(path.data(), path.size());
+            Shard& shard = shards_[key % SHARDS];
+            if (shard.find(key, path.c_str())) continue;
+            fill(shard, key, path.c_str());
+        }
+    }
+
+    FileSystem& backend_;
+    Loader loader_;
+    Shard shards_[SHARDS];
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> bytesSaved_;
+    std::atomic<uint64_t> tooLarge_;    // シャードの上限より大きく、キャッシュできなかった読み込み
+
+    std::deque<std::string> prefetchQueue_;
+    std::mutex prefetchMutex_;
+    std::condition_variable prefetchWake_;
+    bool quit_;
+    std::thread prefetcher_;
+};
+
+/*
+ * 合成したレベル・ロードの読み込み列で比べる
+ *  各レベルは共通のファイル（設定、UI、プレイヤー）と、レベル固有のファイルを読む
+ *  プリフェッチ版は、レベルの読み込み中に次のレベルのファイルをヒントとして渡す
+ */
+void benchmarkLevelLoads(FileSystem& backend, const std::vector<std::string>& common,
+                         const std::vector<std::vector<std::string> >& levels, size_t budgetBytes)
+{
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+
+    std::vector<std::vector<std::string> > trace;
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        std::vector<std::string> load(common);
+        load.insert(load.end(), levels[l].begin(), levels[l].end());
+        trace.push_back(load);
+    }
+
+    Clock::time_point t0 = Clock::now();
+    for (size_t l = 0; l < trace.size(); l++)
+    {
+        for (size_t i = 0; i < trace[l].size(); i++)
+        {
+            delete[] backend.read(const_cast<char*>(trace[l][i].c_str()));
+        }
+    }
+    Clock::time_point t1 = Clock::now();
+
+    {
+        CachedFileSystem cached(backend, budgetBytes);
+        for (size_t l = 0; l < trace.size(); l++)
+        {
+            for (size_t i = 0; i < trace[l].size(); i++) cached.load(trace[l][i].c_str());
+        }
+        printf("cache            : %8.1f ms  ", Milliseconds(Clock::now() - t1).count());
+        cached.report(stdout);
+    }
+
+    Clock::time_point t2 = Clock::now();
+    {
+        CachedFileSystem cached(backend, budgetBytes);
+        for (size_t l = 0; l < trace.size(); l++)
+        {
+            if (l + 1 < levels.size())
+            {
+                for (size_t i = 0; i < levels[l + 1].size(); i++) cached.prefetch(levels[l + 1][i].c_str());
+            }
+            for (size_t i = 0; i < trace[l].size(); i++) cached.load(trace[l][i].c_str());
+        }
+        printf("cache + prefetch : %8.1f ms  ", Milliseconds(Clock::now() - t2).count());
+        cached.report(stdout);
+    }
+
+    printf("no cache         : %8.1f ms\n", Milliseconds(t1 - t0).count());
+}
+
+
+
+/*
+ * 6.10 スレッドごとに分けたサービス
+ *  カウンタ、作業用アロケータ、統計など、全スレッドが頻繁に書き込むサービスを１つのインスタンスにすると、
+ *  ロックか、少なくともキャッシュラインの奪い合いになる
+ *      - スレッドごとに、キャッシュライン境界に揃えたインスタンスを持たせる
+ *      - 使う側はlocal()で自分の分を取るだけ。APIはこれまでのサービスと同じ
+ *      - 全体の値が要るときだけ、aggregate()で明示的にまとめる
+ */
+#include <climits>
+
+// 生きているスレッドに0から詰めて番号を振る。終了したスレッドの番号は再利用する
+// 上限はない。番号は同時に生きているスレッドの数までしか大きくならない
+class ThreadIndex
+{
+public:
+    static int current()
+    {
+        static thread_local Holder holder;
+        return holder.index;
+    }
+
+private:
+    struct Holder
+    {
+        Holder() : index(acquire()) {}
+        ~Holder() { release(index); }
+        int index;
+    };
+
+    static int acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        std::vector<bool>& inUse = used();
+        for (size_t i = 0; i < inUse.size(); i++)
+        {
+            if (!inUse[i])
+            {
+                inUse[i] = true;
+                return int(i);
+            }
+        }
+        inUse.push_back(true);
+        return int(inUse.size() - 1);
+    }
+
+    static void release(int index)
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        used()[index] = false;
+    }
+
+    static std::mutex& mutex() { static std::mutex m; return m; }
+    static std::vector<bool>& used() { static std::vector<bool> bits; return bits; }
+};
+
+/*
+ * スロットは番号の持ち主のスレッドだけが作って書き込む
+ * 番号を引き継いだスレッドは前の持ち主の値にそのまま積み上げるので、まとめた結果は変わらない
+ * スロットの表はCHUNK個ずつのチャンクをつないだもの。最初のチャンクはインスタンスに埋め込んであり、
+ * CHUNK個を超えるスレッドが来たら次のチャンクをCASでつなぐ。チャンクはデストラクタまで外さない
+ * forEach()やaggregate()から他のスレッドの値を読むので、Tのメンバは
+ * relaxedなatomicにするか、まとめるのはフレームの区切りなど書き手が止まっているときに限ること
+ */
+template <class T>
+class Sharded
+{
+public:
+    static const int CHUNK = 64;
+
+    Sharded() {}
+
+    ~Sharded()
+    {
+        Chunk* next = first_.next.load(std::memory_order_relaxed);
+        first_.destroySlots();
+        while (next)
+        {
+            Chunk* chunk = next;
+            next = chunk->next.load(std::memory_order_relaxed);
+            chunk->destroySlots();
+            delete chunk;
+        }
+    }
+
+    T& local()
+    {
+        std::atomic<Slot*>& slot = slotFor(ThreadIndex::current());
+        Slot* mine = slot.load(std::memory_order_relaxed);
+        if (mine == NULL)
+        {
+            mine = newAligned<Slot>();      // 6.8。C++17より前のnewは64バイトに揃えない
+            slot.store(mine, std::memory_order_release);
+        }
+        return mine->value;
+    }
+
+    template <class F>
+    void forEach(F f)
+    {
+        for (Chunk* chunk = &first_; chunk; chunk = chunk->next.load(std::memory_order_acquire))
+        {
+            for (int i = 0; i < CHUNK; i++)
+            {
+                Slot* slot = chunk->slots[i].load(std::memory_order_acquire);
+                if (slot) f(slot->value);
+            }
+        }
+    }
+
+    template <class R, class F>
+    R aggregate(R init, F merge)
+    {
+        forEach([&](T& value) { init = merge(init, value); });
+        return init;
+    }
+
+private:
+    // alignasでsizeofも64の倍数になり、隣のスレッドのスロットと同じラインに乗らない
+    struct alignas(64) Slot
+    {
+        T value;
+    };
+
+    struct Chunk
+    {
+        Chunk() : next(NULL)
+        {
+            for (int i = 0; i < CHUNK; i++) slots[i].store(NULL, std::memory_order_relaxed);
+        }
+
+        void destroySlots()
+        {
+            for (int i = 0; i < CHUNK; i++) deleteAligned(slots[i].load(std::memory_order_relaxed));
+        }
+
+        std::atomic<Slot*> slots[CHUNK];
+        std::atomic<Chunk*> next;
+    };
+
+    // 番号がCHUNK未満ならループは回らない
+    std::atomic<Slot*>& slotFor(int index)
+    {
+        Chunk* chunk = &first_;
+        for (; index >= CHUNK; index -= CHUNK)
+        {
+            Chunk* next = chunk->next.load(std::memory_order_acquire);
+            if (next == NULL)
+            {
+                Chunk* fresh = new Chunk();
+                if (chunk->next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel)) next = fresh;
+                else delete fresh;      // 負けたらnextには勝った方のチャンクが入っている
+            }
+            chunk = next;
+        }
+        return chunk->slots[index];
+    }
+
+    Chunk first_;
+};
+
+enum Counter
+{
+    COUNTER_DRAW_CALLS,
+    COUNTER_COLLISION_TESTS,
+    COUNTER_PATH_QUERIES,
+    COUNTER_COUNT,
+};
+
+// これまでどおり１つのインスタンスをmutexで守る版
+class LockedCounters
+{
+public:
+    LockedCounters() { memset(counts_, 0, sizeof(counts_)); }
+
+    void add(Counter counter, uint64_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counts_[counter] += n;
+    }
+
+    uint64_t total(Counter counter)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return counts_[counter];
+    }
+
+private:
+    std::mutex mutex_;
+    uint64_t counts_[COUNTER_COUNT];
+};
+
+// 同じAPIで、スレッドごとに分けた版
+// 書くのは持ち主だけなので、fetch_addではなくrelaxedのloadとstoreで足りる
+class ShardedCounters
+{
+public:
+    void add(Counter counter, uint64_t n)
+    {
+        std::atomic<uint64_t>& count = counts_.local().counts[counter];
+        count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t total(Counter counter)
+    {
+        return counts_.aggregate(uint64_t(0), [counter](uint64_t sum, Shard& shard)
+        {
+            return sum + shard.counts[counter].load(std::memory_order_relaxed);
+        });
+    }
+
+private:
+    struct Shard
+    {
+        Shard() { for (int i = 0; i < COUNTER_COUNT; i++) counts[i].store(0, std::memory_order_relaxed); }
+        std::atomic<uint64_t> counts[COUNTER_COUNT];
+    };
+
+    Sharded<Shard> counts_;
+};
+
+/*
+ * フレームごとの作業用アロケータ。確保はスレッドごとの領域から進めるだけ
+ * reset()とhighWater()は、ワーカーが止まっているフレームの区切りで呼ぶ
+ */
+class ShardedScratch
+{
+public:
+    static const size_t ARENA_SIZE = 256 * 1024;
+
+    void* allocate(size_t size)
+    {
+        Arena& arena = arenas_.local();
+        size = (size + 15) & ~size_t(15);
+        if (arena.used + size > ARENA_SIZE) return NULL;
+        void* p = arena.memory + arena.used;
+        arena.used += size;
+        if (arena.used > arena.highWater) arena.highWater = arena.used;
+        return p;
+    }
+
+    void reset()
+    {
+        arenas_.forEach([](Arena& arena) { arena.used = 0; });
+    }
+
+    size_t highWater()
+    {
+        return arenas_.aggregate(size_t(0), [](size_t most, Arena& arena)
+        {
+            return std::max(most, arena.highWater);
+        });
+    }
+
+private:
+    struct Arena
+    {
+        Arena() : used(0), highWater(0) {}
+        alignas(16) char memory[ARENA_SIZE];
+        size_t used;
+        size_t highWater;
+    };
+
+    Sharded<Arena> arenas_;
+};
+
+/*
+ * 各スレッドがカウンタを叩き続けたときの比較
+ * スレッド数を増やすと、mutex版はロックとキャッシュラインの奪い合いで遅くなり、
+ * スレッドごとに分けた版はほぼ一定になるはず
+ */
+template <class Counters>
+double runCounterContention(int threadCount, int addsPerThread, uint64_t* total)
+{
+    Counters counters;
+    std::vector<std::thread> threads;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.push_back(std::thread([&counters, addsPerThread]()
+        {
+            for (int i = 0; i < addsPerThread; i++) counters.add(Counter(i % COUNTER_COUNT), 1);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    *total = 0;
+    for (int c = 0; c < COUNTER_COUNT; c++) *total += counters.total(Counter(c));
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void benchmarkCounterContention()
+{
+    const int ADDS_PER_THREAD = 2000000;
+    int maxThreads = std::max(2u, std::thread::hardware_concurrency());
+
+    for (int threadCount = 1; threadCount <= maxThreads; threadCount *= 2)
+    {
+        uint64_t lockedTotal, shardedTotal;
+        double locked = runCounterContention<LockedCounters>(threadCount, ADDS_PER_THREAD, &lockedTotal);
+        double sharded = runCounterContention<ShardedCounters>(threadCount, ADDS_PER_THREAD, &shardedTotal);
+        assert(lockedTotal == shardedTotal);
+
+        printf("%2d threads: mutex %8.1f ms, sharded %8.1f ms (%llu adds)\n",
+               threadCount, locked, sharded, (unsigned long long)shardedTotal);
+    }
+}
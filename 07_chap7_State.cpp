@@ -259,3 +259,2024 @@ private:
  *  一般的な解決法は２つある
  */
  
+
+
+
+/*
+ * 7.8 コンパイル時の遷移表
+ *  switch版（7.3）も状態オブジェクト版（7.4〜7.6）も、遷移のロジックがあちこちに散らばる
+ *  状態オブジェクト版は、入力のたびにアクターごとのvirtual呼び出しにもなる
+ *  何千ものアクターを動かすので、遷移 (状態, 入力) -> (次の状態, 動作) をconstexprの表として宣言する
+ *    - 表はコンパイル時に [状態][入力] の平坦な配列になり、handleInput()は配列を引くだけ
+ *    - 表に書かれていない組み合わせがあればコンパイルエラーにする
+ *      （何もしない組み合わせも、noActionとして明示する）
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+enum Input
+{
+  PRESS_B,
+  PRESS_DOWN,
+  RELEASE_DOWN,
+  LAND,         // 物理演算から届く着地イベント
+
+  INPUT_COUNT
+};
+
+enum Image
+{
+  IMAGE_STAND,
+  IMAGE_JUMP,
+  IMAGE_DUCK,
+  IMAGE_DIVE
+};
+
+const int STATE_COUNT = STATE_DIVING + 1;
+const int JUMP_VELOCITY = 10;
+const int MAX_CHARGE = 60;
+
+// 以降の節でも使う、Heroineの状態とデータだけを持つアクター
+struct Actor
+{
+  State state;
+  Image graphics;
+  int yVelocity;
+  int chargeTime;
+  int bombs;
+};
+
+typedef void (*Action)(Actor& actor);
+
+void noAction(Actor& actor) {}
+void startJump(Actor& actor)  { actor.yVelocity = JUMP_VELOCITY; actor.graphics = IMAGE_JUMP; }
+void startDuck(Actor& actor)  { actor.chargeTime = 0; actor.graphics = IMAGE_DUCK; }
+void startDive(Actor& actor)  { actor.graphics = IMAGE_DIVE; }
+void stand(Actor& actor)      { actor.yVelocity = 0; actor.graphics = IMAGE_STAND; }
+
+struct Transition
+{
+  State from;
+  Input input;
+  State to;
+  Action action;
+};
+
+constexpr Transition TRANSITIONS[] =
+{
+  { STATE_STANDING, PRESS_B,      STATE_JUMPING,  startJump },
+  { STATE_STANDING, PRESS_DOWN,   STATE_DUCKING,  startDuck },
+  { STATE_STANDING, RELEASE_DOWN, STATE_STANDING, noAction  },
+  { STATE_STANDING, LAND,         STATE_STANDING, noAction  },
+
+  { STATE_JUMPING,  PRESS_B,      STATE_JUMPING,  noAction  },
+  { STATE_JUMPING,  PRESS_DOWN,   STATE_DIVING,   startDive },
+  { STATE_JUMPING,  RELEASE_DOWN, STATE_JUMPING,  noAction  },
+  { STATE_JUMPING,  LAND,         STATE_STANDING, stand     },
+
+  { STATE_DUCKING,  PRESS_B,      STATE_DUCKING,  noAction  },
+  { STATE_DUCKING,  PRESS_DOWN,   STATE_DUCKING,  noAction  },
+  { STATE_DUCKING,  RELEASE_DOWN, STATE_STANDING, stand     },
+  { STATE_DUCKING,  LAND,         STATE_DUCKING,  noAction  },
+
+  { STATE_DIVING,   PRESS_B,      STATE_DIVING,   noAction  },
+  { STATE_DIVING,   PRESS_DOWN,   STATE_DIVING,   noAction  },
+  { STATE_DIVING,   RELEASE_DOWN, STATE_DIVING,   noAction  },
+  { STATE_DIVING,   LAND,         STATE_STANDING, stand     },
+};
+
+struct TransitionCell
+{
+  State next;
+  Action action;
+};
+
+struct TransitionTable
+{
+  TransitionCell cells[STATE_COUNT][INPUT_COUNT];
+};
+
+// すべての (状態, 入力) がちょうど１回ずつ書かれているか
+template <size_t N>
+constexpr bool isComplete(const Transition (&transitions)[N])
+{
+  int count[STATE_COUNT][INPUT_COUNT] = {};
+  for (size_t i = 0; i < N; i++)
+  {
+    count[transitions[i].from][transitions[i].input]++;
+  }
+  for (int s = 0; s < STATE_COUNT; s++)
+  {
+    for (int i = 0; i < INPUT_COUNT; i++)
+    {
+      if (count[s][i] != 1) return false;
+    }
+  }
+  return true;
+}
+
+template <size_t N>
+constexpr TransitionTable buildTable(const Transition (&transitions)[N])
+{
+  TransitionTable table = {};
+  for (size_t i = 0; i < N; i++)
+  {
+    TransitionCell& cell = table.cells[transitions[i].from][transitions[i].input];
+    cell.next = transitions[i].to;
+    cell.action = transitions[i].action;
+  }
+  return table;
+}
+
+static_assert(isComplete(TRANSITIONS),
+              "every (state, input) pair must appear exactly once in TRANSITIONS");
+
+constexpr TransitionTable TRANSITION_TABLE = buildTable(TRANSITIONS);
+
+inline void handleInput(Actor& actor, Input input)
+{
+  const TransitionCell& cell = TRANSITION_TABLE.cells[actor.state][input];
+  cell.action(actor);
+  actor.state = cell.next;
+}
+
+/*
+ * 比較用：同じ遷移を7.3のswitchで書いたもの
+ */
+void handleInputSwitch(Actor& actor, Input input)
+{
+  switch (actor.state)
+  {
+    case STATE_STANDING:
+      if (input == PRESS_B)         { startJump(actor); actor.state = STATE_JUMPING; }
+      else if (input == PRESS_DOWN) { startDuck(actor); actor.state = STATE_DUCKING; }
+      break;
+
+    case STATE_JUMPING:
+      if (input == PRESS_DOWN)      { startDive(actor); actor.state = STATE_DIVING; }
+      else if (input == LAND)       { stand(actor);     actor.state = STATE_STANDING; }
+      break;
+
+    case STATE_DUCKING:
+      if (input == RELEASE_DOWN)    { stand(actor);     actor.state = STATE_STANDING; }
+      break;
+
+    case STATE_DIVING:
+      if (input == LAND)            { stand(actor);     actor.state = STATE_STANDING; }
+      break;
+  }
+}
+
+/*
+ * 比較用：同じ遷移を7.4の状態オブジェクトで書いたもの（状態は共有の静的インスタンス）
+ */
+class ActorState
+{
+public:
+  virtual ~ActorState() {}
+  virtual ActorState* handleInput(Actor& actor, Input input) = 0;
+
+  static ActorState* const states[STATE_COUNT];
+};
+
+class StandingActorState : public ActorState
+{
+public:
+  virtual ActorState* handleInput(Actor& actor, Input input) {
+    if (input == PRESS_B)    { startJump(actor); actor.state = STATE_JUMPING; }
+    if (input == PRESS_DOWN) { startDuck(actor); actor.state = STATE_DUCKING; }
+    return states[actor.state];
+  }
+};
+
+class JumpingActorState : public ActorState
+{
+public:
+  virtual ActorState* handleInput(Actor& actor, Input input) {
+    if (input == PRESS_DOWN) { startDive(actor); actor.state = STATE_DIVING; }
+    if (input == LAND)       { stand(actor);     actor.state = STATE_STANDING; }
+    return states[actor.state];
+  }
+};
+
+class DuckingActorState : public ActorState
+{
+public:
+  virtual ActorState* handleInput(Actor& actor, Input input) {
+    if (input == RELEASE_DOWN) { stand(actor); actor.state = STATE_STANDING; }
+    return states[actor.state];
+  }
+};
+
+class DivingActorState : public ActorState
+{
+public:
+  virtual ActorState* handleInput(Actor& actor, Input input) {
+    if (input == LAND) { stand(actor); actor.state = STATE_STANDING; }
+    return states[actor.state];
+  }
+};
+
+StandingActorState standingActorState;
+JumpingActorState jumpingActorState;
+DuckingActorState duckingActorState;
+DivingActorState divingActorState;
+
+ActorState* const ActorState::states[STATE_COUNT] =
+{
+  &standingActorState, &jumpingActorState, &duckingActorState, &divingActorState
+};
+
+/*
+ * actorCount体のアクターに、同じ乱数列の入力を与えて３つの版を比べる
+ */
+void benchmarkTransitions(int actorCount, int frames)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::nano> Nanoseconds;
+
+  std::vector<Input> inputs(size_t(actorCount) * frames);
+  srand(1);
+  for (size_t i = 0; i < inputs.size(); i++) inputs[i] = Input(rand() % INPUT_COUNT);
+
+  Actor initial = { STATE_STANDING, IMAGE_STAND, 0, 0, 0 };
+  std::vector<Actor> table(actorCount, initial);
+  std::vector<Actor> switched(actorCount, initial);
+  std::vector<Actor> objects(actorCount, initial);
+  std::vector<ActorState*> states(actorCount, ActorState::states[STATE_STANDING]);
+
+  Clock::time_point t0 = Clock::now();
+  for (size_t i = 0; i < inputs.size(); i++) handleInput(table[i % actorCount], inputs[i]);
+  Clock::time_point t1 = Clock::now();
+  for (size_t i = 0; i < inputs.size(); i++) handleInputSwitch(switched[i % actorCount], inputs[i]);
+  Clock::time_point t2 = Clock::now();
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    size_t a = i % actorCount;
+    states[a] = states[a]->handleInput(objects[a], inputs[i]);
+  }
+  Clock::time_point t3 = Clock::now();
+
+  bool same = true;
+  for (int a = 0; a < actorCount; a++)
+  {
+    same = same && table[a].state == switched[a].state && table[a].state == objects[a].state;
+  }
+
+  double count = double(inputs.size());
+  printf("table  : %.2f ns/input\n", Nanoseconds(t1 - t0).count() / count);
+  printf("switch : %.2f ns/input\n", Nanoseconds(t2 - t1).count() / count);
+  printf("virtual: %.2f ns/input\n", Nanoseconds(t3 - t2).count() / count);
+  printf("results %s\n", same ? "match" : "DIFFER");
+}
+
+
+
+/*
+ * 7.9 状態ごとにまとめて更新する
+ *  Heroine::update()はアクターごとにstate_->update(*this)を呼ぶ
+ *  いろいろな状態のアクターが混ざっていると、毎フレーム別々のupdate()の間を飛び回ることになり、
+ *  命令キャッシュにも分岐予測にもやさしくない
+ *  アクターを現在の状態ごとのバケツ（連続した配列）に入れておき、状態ごとに１つのループで更新する
+ *    - 入力や着地による遷移は、アクターのstateを書き換えて記録するだけ
+ *    - バケツ間の移動はapplyTransitions()でまとめて行う（update()の最初と最後に呼ばれる）
+ *  アクターは移動するので、外からはActorIdで指す
+ */
+#include <cassert>
+#include <cstdint>
+
+const int GRAVITY = 1;
+
+// 状態ごとの更新。trueを返したら着地（LANDを入力する）
+inline bool updateStanding(Actor& actor) { return false; }
+
+inline bool updateJumping(Actor& actor)
+{
+  actor.yVelocity -= GRAVITY;
+  return actor.yVelocity <= -JUMP_VELOCITY;
+}
+
+inline bool updateDucking(Actor& actor)
+{
+  actor.chargeTime++;
+  if (actor.chargeTime > MAX_CHARGE)
+  {
+    actor.bombs++;      // superBomb()
+    actor.chargeTime = 0;
+  }
+  return false;
+}
+
+inline bool updateDiving(Actor& actor)
+{
+  actor.yVelocity -= 2 * GRAVITY;
+  return actor.yVelocity <= -2 * JUMP_VELOCITY;
+}
+
+class ActorSystem
+{
+public:
+  typedef uint32_t ActorId;
+
+  ActorId add(const Actor& actor)
+  {
+    ActorId id = ActorId(locations_.size());
+    Bucket& bucket = buckets_[actor.state];
+    Location location = { actor.state, uint32_t(bucket.actors.size()) };
+    locations_.push_back(location);
+    bucket.actors.push_back(actor);
+    bucket.ids.push_back(id);
+    return id;
+  }
+
+  Actor& get(ActorId id)
+  {
+    const Location& location = locations_[id];
+    return buckets_[location.state].actors[location.index];
+  }
+
+  size_t count(State state) const { return buckets_[state].actors.size(); }
+
+  // 7.8の遷移表で遷移する。バケツの移動は後回し
+  void handleInput(ActorId id, Input input)
+  {
+    Actor& actor = get(id);
+    const TransitionCell& cell = TRANSITION_TABLE.cells[actor.state][input];
+    cell.action(actor);
+    actor.state = cell.next;
+    if (actor.state != locations_[id].state) moved_.push_back(id);
+  }
+
+  // 入力で遷移したアクターは、先に新しい状態のバケツへ移してから更新する
+  void update()
+  {
+    applyTransitions();
+    updateBucket<updateStanding>(STATE_STANDING);
+    updateBucket<updateJumping>(STATE_JUMPING);
+    updateBucket<updateDucking>(STATE_DUCKING);
+    updateBucket<updateDiving>(STATE_DIVING);
+    applyTransitions();
+  }
+
+  // stateが変わったアクターを新しいバケツへ移す
+  // 元のバケツからは末尾と入れ替えて取り除くので、O(移動数)
+  void applyTransitions()
+  {
+    for (size_t i = 0; i < moved_.size(); i++)
+    {
+      ActorId id = moved_[i];
+      Location& location = locations_[id];
+      Bucket& from = buckets_[location.state];
+      Actor actor = from.actors[location.index];
+
+      // 同じフレームで元の状態に戻った、あるいは既に移動済み
+      if (actor.state == location.state) continue;
+
+      ActorId last = from.ids.back();
+      from.actors[location.index] = from.actors.back();
+      from.ids[location.index] = last;
+      locations_[last].index = location.index;
+      from.actors.pop_back();
+      from.ids.pop_back();
+
+      Bucket& to = buckets_[actor.state];
+      location.state = actor.state;
+      location.index = uint32_t(to.actors.size());
+      to.actors.push_back(actor);
+      to.ids.push_back(id);
+    }
+    moved_.clear();
+  }
+
+private:
+  struct Bucket
+  {
+    std::vector<Actor> actors;
+    std::vector<ActorId> ids;
+  };
+
+  struct Location
+  {
+    State state;
+    uint32_t index;
+  };
+
+  // 状態ごとの更新関数はテンプレート引数なので、ループの中でインライン展開される
+  template <bool (*Update)(Actor&)>
+  void updateBucket(State state)
+  {
+    Bucket& bucket = buckets_[state];
+    for (size_t i = 0; i < bucket.actors.size(); i++)
+    {
+      if (Update(bucket.actors[i])) handleInput(bucket.ids[i], LAND);
+    }
+  }
+
+  Bucket buckets_[STATE_COUNT];
+  std::vector<Location> locations_;
+  std::vector<ActorId> moved_;
+};
+
+/*
+ * 比較用：状態の混ざった配列を、アクターごとのvirtual update()で更新する
+ */
+class ActorUpdater
+{
+public:
+  virtual ~ActorUpdater() {}
+  virtual bool update(Actor& actor) = 0;
+};
+
+template <bool (*Update)(Actor&)>
+class ActorUpdaterFor : public ActorUpdater
+{
+public:
+  virtual bool update(Actor& actor) { return Update(actor); }
+};
+
+/*
+ * 100k体を４つの状態にばらまいて、１フレームの更新時間を比べる
+ * 毎フレーム1%のアクターに同じ乱数列の入力を与えて、状態が混ざったままになるようにする
+ */
+void benchmarkBucketedUpdate(int actorCount, int frames)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::micro> Microseconds;
+
+  ActorUpdaterFor<updateStanding> standing;
+  ActorUpdaterFor<updateJumping> jumping;
+  ActorUpdaterFor<updateDucking> ducking;
+  ActorUpdaterFor<updateDiving> diving;
+  ActorUpdater* updaters[STATE_COUNT] = { &standing, &jumping, &ducking, &diving };
+
+  std::vector<Actor> mixed(actorCount);
+  ActorSystem system;
+  srand(1);
+  for (int i = 0; i < actorCount; i++)
+  {
+    Actor actor = { State(rand() % STATE_COUNT), IMAGE_STAND, 0, rand() % MAX_CHARGE, 0 };
+    mixed[i] = actor;
+    system.add(actor);
+  }
+
+  std::vector<std::pair<int, Input> > inputs(size_t(frames) * (actorCount / 100));
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    inputs[i] = std::make_pair(rand() % actorCount, Input(rand() % INPUT_COUNT));
+  }
+  size_t perFrame = actorCount / 100;
+
+  Clock::time_point t0 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    for (size_t i = frame * perFrame; i < (frame + 1) * perFrame; i++)
+    {
+      handleInput(mixed[inputs[i].first], inputs[i].second);
+    }
+    for (int i = 0; i < actorCount; i++)
+    {
+      Actor& actor = mixed[i];
+      if (updaters[actor.state]->update(actor)) handleInput(actor, LAND);
+    }
+  }
+  Clock::time_point t1 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    for (size_t i = frame * perFrame; i < (frame + 1) * perFrame; i++)
+    {
+      system.handleInput(ActorSystem::ActorId(inputs[i].first), inputs[i].second);
+    }
+    system.update();
+  }
+  Clock::time_point t2 = Clock::now();
+
+  // 更新の順番が違うだけで、同じ計算になっているはず
+  for (int i = 0; i < actorCount; i++)
+  {
+    const Actor& a = mixed[i];
+    const Actor& b = system.get(ActorSystem::ActorId(i));
+    assert(a.state == b.state && a.graphics == b.graphics && a.yVelocity == b.yVelocity &&
+           a.chargeTime == b.chargeTime && a.bombs == b.bombs);
+  }
+
+  printf("virtual per actor: %.1f us/frame\n", Microseconds(t1 - t0).count() / frames);
+  printf("bucketed by state: %.1f us/frame\n", Microseconds(t2 - t1).count() / frames);
+  printf("standing %zu, jumping %zu, ducking %zu, diving %zu\n",
+         system.count(STATE_STANDING), system.count(STATE_JUMPING),
+         system.count(STATE_DUCKING), system.count(STATE_DIVING));
+}
+
+
+
+/*
+ * 7.10 ヒープを使わない状態オブジェクト
+ *  7.7で残った問題：状態のオブジェクトをどこに置くか
+ *  DuckingStateのようにchargeTime_を持つ状態は、遷移のたびにnewして抜けるときにdeleteすることになる
+ *    - 状態を持たない状態（Standing/Jumping/Diving）は、共有の静的インスタンスを使う
+ *    - 状態を持つ状態（Ducking）は、アクターの中に置いた「一番大きな状態」の大きさのバッファに
+ *      placement newで構築する
+ *    - 入るときと抜けるときにenter()/exit()を呼ぶ
+ *  状態の中から自分を壊さないよう、遷移はtransitionTo<S>()で予約し、handleInput()/update()から
+ *  戻ったところで行う
+ */
+#include <cstddef>
+#include <new>
+
+// 7.13のタイマー・ホイールが返すハンドル。7.13のTimedDuckingStateが状態のバッファに入るので、先に宣言しておく
+namespace timer {
+
+struct TimerHandle
+{
+  uint32_t index;
+  uint32_t generation;
+};
+
+}
+
+namespace inplace {
+
+class Heroine;
+
+class HeroineState
+{
+public:
+  virtual ~HeroineState() {}
+  virtual void enter(Heroine& heroine) {}
+  virtual void exit(Heroine& heroine) {}
+  virtual void handleInput(Heroine& heroine, Input input) {}
+  virtual void update(Heroine& heroine) {}
+};
+
+// SHAREDがtrueの状態は全アクターで１つのインスタンスを共有する
+class StandingState : public HeroineState
+{
+public:
+  static const bool SHARED = true;
+  virtual void enter(Heroine& heroine);
+  virtual void handleInput(Heroine& heroine, Input input);
+};
+
+class JumpingState : public HeroineState
+{
+public:
+  static const bool SHARED = true;
+  virtual void enter(Heroine& heroine);
+  virtual void handleInput(Heroine& heroine, Input input);
+};
+
+class DivingState : public HeroineState
+{
+public:
+  static const bool SHARED = true;
+  virtual void enter(Heroine& heroine);
+  virtual void handleInput(Heroine& heroine, Input input);
+};
+
+class DuckingState : public HeroineState
+{
+public:
+  static const bool SHARED = false;
+
+  DuckingState()
+    : chargeTime_(0)
+  {}
+
+  virtual void enter(Heroine& heroine);
+  virtual void handleInput(Heroine& heroine, Input input);
+  virtual void update(Heroine& heroine);
+
+private:
+  int chargeTime_;
+};
+
+// 7.13のタイマー版。関数の中身はタイマー・ホイールと一緒に7.13で定義する
+class TimedDuckingState : public HeroineState
+{
+public:
+  static const bool SHARED = false;
+
+  virtual void enter(Heroine& heroine);
+  virtual void exit(Heroine& heroine);
+  virtual void handleInput(Heroine& heroine, Input input);
+  // update()は要らない
+
+private:
+  static void charged(void* context, uint32_t value);
+
+  Heroine* heroine_;
+  timer::TimerHandle charge_;
+};
+
+// アクターごとの状態を置く領域。状態を持つ状態を増やしたら、ここにも加える
+const size_t STATE_BUFFER_SIZE =
+  sizeof(DuckingState) > sizeof(TimedDuckingState) ? sizeof(DuckingState) : sizeof(TimedDuckingState);
+
+class Heroine
+{
+public:
+  Heroine()
+    : state_(NULL), pending_(NULL), stateInBuffer_(false)
+  {
+    Actor data = { STATE_STANDING, IMAGE_STAND, 0, 0, 0 };
+    data_ = data;
+    change(&makeState<StandingState>);
+  }
+
+  ~Heroine() { leave(); }
+
+  // state_はこのオブジェクト自身のbuffer_を指すので、コピーもムーブもできない
+  Heroine(const Heroine&) = delete;
+  Heroine& operator=(const Heroine&) = delete;
+
+  void handleInput(Input input)
+  {
+    state_->handleInput(*this, input);
+    applyPending();
+  }
+
+  void update()
+  {
+    state_->update(*this);
+    applyPending();
+  }
+
+  // 次の状態を予約する
+  template <class S>
+  void transitionTo() { pending_ = &makeState<S>; }
+
+  void setGraphics(Image image) { data_.graphics = image; }
+  void setVelocity(int yVelocity) { data_.yVelocity = yVelocity; }
+  void superBomb() { data_.bombs++; }
+  const Actor& data() const { return data_; }
+
+private:
+  typedef HeroineState* (*StateFactory)(void* buffer);
+
+  template <class S>
+  static HeroineState* makeState(void* buffer)
+  {
+    static_assert(S::SHARED || sizeof(S) <= STATE_BUFFER_SIZE, "enlarge STATE_BUFFER_SIZE");
+    static_assert(S::SHARED || alignof(S) <= alignof(std::max_align_t), "state is over-aligned");
+
+    if (S::SHARED)
+    {
+      static S instance;
+      return &instance;
+    }
+    return new (buffer) S();
+  }
+
+  void leave()
+  {
+    if (!state_) return;
+    state_->exit(*this);
+    if (stateInBuffer_) state_->~HeroineState();
+    state_ = NULL;
+  }
+
+  void change(StateFactory factory)
+  {
+    leave();
+    state_ = factory(buffer_);
+    stateInBuffer_ = static_cast<void*>(state_) == static_cast<void*>(buffer_);
+    state_->enter(*this);
+  }
+
+  // enter()がさらに遷移を予約することもある
+  void applyPending()
+  {
+    while (pending_)
+    {
+      StateFactory factory = pending_;
+      pending_ = NULL;
+      change(factory);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buffer_[STATE_BUFFER_SIZE];
+  HeroineState* state_;
+  StateFactory pending_;
+  bool stateInBuffer_;
+  Actor data_;
+};
+
+void StandingState::enter(Heroine& heroine)
+{
+  heroine.setVelocity(0);
+  heroine.setGraphics(IMAGE_STAND);
+}
+
+void StandingState::handleInput(Heroine& heroine, Input input)
+{
+  if (input == PRESS_B)         heroine.transitionTo<JumpingState>();
+  else if (input == PRESS_DOWN) heroine.transitionTo<DuckingState>();
+}
+
+void JumpingState::enter(Heroine& heroine)
+{
+  heroine.setVelocity(JUMP_VELOCITY);
+  heroine.setGraphics(IMAGE_JUMP);
+}
+
+void JumpingState::handleInput(Heroine& heroine, Input input)
+{
+  if (input == PRESS_DOWN) heroine.transitionTo<DivingState>();
+  else if (input == LAND)  heroine.transitionTo<StandingState>();
+}
+
+void DivingState::enter(Heroine& heroine)
+{
+  heroine.setGraphics(IMAGE_DIVE);
+}
+
+void DivingState::handleInput(Heroine& heroine, Input input)
+{
+  if (input == LAND) heroine.transitionTo<StandingState>();
+}
+
+// 構築されるたびにchargeTime_は0から始まるので、リセットし忘れることがない
+void DuckingState::enter(Heroine& heroine)
+{
+  heroine.setGraphics(IMAGE_DUCK);
+}
+
+void DuckingState::handleInput(Heroine& heroine, Input input)
+{
+  if (input == RELEASE_DOWN) heroine.transitionTo<StandingState>();
+}
+
+void DuckingState::update(Heroine& heroine)
+{
+  chargeTime_++;
+  if (chargeTime_ > MAX_CHARGE)
+  {
+    heroine.superBomb();
+    chargeTime_ = 0;
+  }
+}
+
+}
+
+/*
+ * 遷移を繰り返してヒープ確保の回数を数える
+ * 回数はCOUNT_ALLOCATIONSを1にしてビルドしたときだけ数える（count_allocations.h）
+ */
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+
+#if COUNT_ALLOCATIONS
+#include "count_allocations.h"
+#endif
+
+void benchmarkStateChanges(int transitions)
+{
+  typedef std::chrono::steady_clock Clock;
+
+  inplace::Heroine heroine;
+#if COUNT_ALLOCATIONS
+  size_t before = allocationCount.load();
+#endif
+  Clock::time_point start = Clock::now();
+
+  // 立つ -> 屈む -> 立つ -> ジャンプ -> ダイブ -> 着地 ...
+  static const Input cycle[] = { PRESS_DOWN, RELEASE_DOWN, PRESS_B, PRESS_DOWN, LAND };
+  for (int i = 0; i < transitions; i++)
+  {
+    heroine.handleInput(cycle[i % 5]);
+    heroine.update();
+  }
+
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+#if COUNT_ALLOCATIONS
+  printf("%d transitions: %.2f ns/transition, %zu allocations\n",
+         transitions, ns / transitions, allocationCount.load() - before);
+#else
+  printf("%d transitions: %.2f ns/transition\n", transitions, ns / transitions);
+#endif
+}
+
+
+
+/*
+ * 7.11 階層型の状態と、プッシュダウン・オートマトン
+ *  これまでの状態機械は平坦なので、「地上にいるならBでジャンプ」のような共通の振る舞いを
+ *  STATE_STANDINGとSTATE_DUCKINGのそれぞれに書くことになる
+ *  また、一時的な状態（発砲中）に入って、終わったら元の状態に戻る方法がない
+ *    - 階層型：各状態は親を持つ。状態が処理しなかった入力は親へ回す（深さに比例するだけ）
+ *    - プッシュダウン：状態のスタックを持つ。深さの上限は固定で、スタックはアクターの中に置く
+ *  どちらも確保は一切しない
+ */
+#include <cassert>
+
+namespace hierarchical {
+
+// 発砲ボタンの入力を7.8のInputに足す
+enum
+{
+  PRESS_FIRE = INPUT_COUNT,
+  RELEASE_FIRE,
+};
+
+enum HeroineState
+{
+  ON_GROUND,    // 親だけの状態
+  STANDING,
+  DUCKING,
+  IN_AIR,       // 親だけの状態
+  JUMPING,
+  DIVING,
+  FIRING,       // プッシュして使う
+
+  HEROINE_STATE_COUNT,
+  NO_STATE = -1
+};
+
+const int PARENT[HEROINE_STATE_COUNT] =
+{
+  NO_STATE,     // ON_GROUND
+  ON_GROUND,    // STANDING
+  ON_GROUND,    // DUCKING
+  NO_STATE,     // IN_AIR
+  IN_AIR,       // JUMPING
+  IN_AIR,       // DIVING
+  NO_STATE,     // FIRING
+};
+
+class Heroine
+{
+public:
+  static const int MAX_DEPTH = 4;
+
+  Heroine()
+    : depth_(1), level_(0)
+  {
+    Actor data = { STATE_STANDING, IMAGE_STAND, 0, 0, 0 };
+    data_ = data;
+    stack_[0] = STANDING;
+  }
+
+  // スタックの上から順に、各状態から親へとたどり、最初に処理した状態で終わる
+  // 発砲中でも、発砲に関係ない入力（着地など）は下の状態が処理する
+  void handleInput(int input)
+  {
+    for (level_ = depth_ - 1; level_ >= 0; level_--)
+    {
+      for (int state = stack_[level_]; state != NO_STATE; state = PARENT[state])
+      {
+        if (HANDLERS[state](*this, input)) return;
+      }
+    }
+  }
+
+  HeroineState current() const { return stack_[depth_ - 1]; }
+  int depth() const { return depth_; }
+  const Actor& data() const { return data_; }
+
+private:
+  typedef bool (*Handler)(Heroine& heroine, int input);
+
+  // 入力を処理している段の状態を置き換える（発砲中に着地したら、FIRINGの下がSTANDINGになる）
+  void change(HeroineState state) { stack_[level_] = state; }
+
+  // 上限を超えるプッシュは無視する
+  void push(HeroineState state)
+  {
+    assert(depth_ < MAX_DEPTH);
+    if (depth_ < MAX_DEPTH) stack_[depth_++] = state;
+  }
+
+  void pop()
+  {
+    if (depth_ > 1) depth_--;
+  }
+
+  static bool onGround(Heroine& heroine, int input)
+  {
+    if (input == PRESS_B)
+    {
+      startJump(heroine.data_);
+      heroine.change(JUMPING);
+      return true;
+    }
+    if (input == PRESS_FIRE)
+    {
+      heroine.push(FIRING);
+      return true;
+    }
+    return false;
+  }
+
+  static bool standing(Heroine& heroine, int input)
+  {
+    if (input == PRESS_DOWN)
+    {
+      startDuck(heroine.data_);
+      heroine.change(DUCKING);
+      return true;
+    }
+    return false;
+  }
+
+  static bool ducking(Heroine& heroine, int input)
+  {
+    if (input == RELEASE_DOWN)
+    {
+      stand(heroine.data_);
+      heroine.change(STANDING);
+      return true;
+    }
+    // PRESS_B（屈んでいてもジャンプ）はON_GROUNDに任せる
+    return false;
+  }
+
+  static bool inAir(Heroine& heroine, int input)
+  {
+    if (input == LAND)
+    {
+      stand(heroine.data_);
+      heroine.change(STANDING);
+      return true;
+    }
+    if (input == PRESS_FIRE)
+    {
+      heroine.push(FIRING);
+      return true;
+    }
+    return false;
+  }
+
+  static bool jumping(Heroine& heroine, int input)
+  {
+    if (input == PRESS_DOWN)
+    {
+      startDive(heroine.data_);
+      heroine.change(DIVING);
+      return true;
+    }
+    return false;
+  }
+
+  static bool diving(Heroine& heroine, int input) { return false; }
+
+  // 発砲が終わったら、プッシュする前の状態に戻る。発砲中のPRESS_FIREは無視する
+  static bool firing(Heroine& heroine, int input)
+  {
+    if (input == RELEASE_FIRE)
+    {
+      heroine.pop();
+      return true;
+    }
+    return input == PRESS_FIRE;
+  }
+
+  static const Handler HANDLERS[HEROINE_STATE_COUNT];
+
+  HeroineState stack_[MAX_DEPTH];
+  int depth_;
+  int level_;       // handleInput()中の、入力を処理している段
+  Actor data_;
+};
+
+const Heroine::Handler Heroine::HANDLERS[HEROINE_STATE_COUNT] =
+{
+  &Heroine::onGround,
+  &Heroine::standing,
+  &Heroine::ducking,
+  &Heroine::inAir,
+  &Heroine::jumping,
+  &Heroine::diving,
+  &Heroine::firing,
+};
+
+}
+
+/*
+ * 入力１つあたりのコストを7.8の平坦な遷移表と比べる
+ * 同じ入力列でも、階層版はDUCKINGでのPRESS_Bでジャンプするので、結果の状態は一致しない
+ */
+void benchmarkHierarchical(int actorCount, int frames)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::nano> Nanoseconds;
+
+  std::vector<int> inputs(size_t(actorCount) * frames);
+  srand(1);
+  for (size_t i = 0; i < inputs.size(); i++) inputs[i] = rand() % (hierarchical::RELEASE_FIRE + 1);
+
+  Actor initial = { STATE_STANDING, IMAGE_STAND, 0, 0, 0 };
+  std::vector<Actor> flat(actorCount, initial);
+  std::vector<hierarchical::Heroine> nested(actorCount);
+
+  Clock::time_point t0 = Clock::now();
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    // 平坦な表は発砲を知らないので、その入力は捨てる
+    if (inputs[i] < INPUT_COUNT) handleInput(flat[i % actorCount], Input(inputs[i]));
+  }
+  Clock::time_point t1 = Clock::now();
+  for (size_t i = 0; i < inputs.size(); i++) nested[i % actorCount].handleInput(inputs[i]);
+  Clock::time_point t2 = Clock::now();
+
+  double count = double(inputs.size());
+  printf("flat table  : %.2f ns/input\n", Nanoseconds(t1 - t0).count() / count);
+  printf("hierarchical: %.2f ns/input (sizeof Heroine %zu bytes)\n",
+         Nanoseconds(t2 - t1).count() / count, sizeof(hierarchical::Heroine));
+}
+
+
+
+/*
+ * 7.12 状態機械の並列更新
+ *  Heroine::handleInput()やupdate()はアクターを直接書き換え、heroine.superBomb()やsetGraphics()も
+ *  その場で呼ぶので、たくさんのアクターを並列に更新すると危ない
+ *    - アクターを連続した範囲に分けて、ワーカースレッドに割り当てる
+ *    - 状態の処理が書き換えてよいのは自分の状態機械（state/yVelocity/chargeTime）だけ
+ *      ワールドは読むだけ
+ *    - 副作用（グラフィックの変更、スーパーボム、弾の生成）はスレッドごとのコマンドリストに積む
+ *    - 全スレッドが終わったら（バリア）、コマンドリストをスレッドの順に適用する
+ *  範囲はアクターの順に並んでいるので、適用順はアクターの順と同じになり、スレッド数によらず結果は同じ
+ */
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace parallel {
+
+const int NO_INPUT = INPUT_COUNT;
+
+enum EffectType
+{
+  EFFECT_SET_GRAPHICS,
+  EFFECT_SUPER_BOMB,
+  EFFECT_SPAWN_SHOCKWAVE,
+};
+
+struct Effect
+{
+  uint32_t actor;
+  EffectType type;
+  int value;
+};
+
+// スレッドごとのコマンドリスト。隣のスレッドと同じキャッシュラインに乗らないようにする
+// C++14のstd::allocatorはalignas(64)を守らないので、std::vectorに入れても確実な手作業の余白にする
+// ヘッダの後ろに１ライン分空けておけば、配列の先頭がどこにあっても隣のヘッダとは別のラインになる
+struct EffectList
+{
+  std::vector<Effect> effects;
+  char padding[64];
+
+  void add(uint32_t actor, EffectType type, int value)
+  {
+    Effect effect = { actor, type, value };
+    effects.push_back(effect);
+  }
+};
+
+struct Shockwave
+{
+  uint32_t source;
+  int power;
+};
+
+struct World
+{
+  int gravity;
+  std::vector<Actor> actors;
+  std::vector<Shockwave> shockwaves;
+  int totalBombs;
+};
+
+// 7.8の動作はgraphicsも書くので、graphicsの変更はここで横取りしてコマンドにする
+inline void runAction(uint32_t index, Actor& actor, Action action, EffectList& out)
+{
+  Image graphics = actor.graphics;
+  action(actor);
+  if (actor.graphics != graphics)
+  {
+    out.add(index, EFFECT_SET_GRAPHICS, actor.graphics);
+    actor.graphics = graphics;
+  }
+}
+
+// 1体分の入力と更新。書いてよいのはactorの状態機械の部分だけ
+// worldは読むだけ。world.actorsは他のスレッドが書き換えている最中なので読まない
+void stepActor(uint32_t index, Actor& actor, int input, const World& world, EffectList& out)
+{
+  State before = actor.state;
+  if (input != NO_INPUT)
+  {
+    const TransitionCell& cell = TRANSITION_TABLE.cells[actor.state][input];
+    runAction(index, actor, cell.action, out);
+    actor.state = cell.next;
+  }
+
+  switch (actor.state)
+  {
+    case STATE_JUMPING:
+    case STATE_DIVING:
+      actor.yVelocity -= world.gravity * (actor.state == STATE_DIVING ? 2 : 1);
+      if (actor.yVelocity <= -JUMP_VELOCITY && before == actor.state)
+      {
+        runAction(index, actor, stand, out);
+        actor.state = STATE_STANDING;
+      }
+      break;
+
+    case STATE_DUCKING:
+      if (++actor.chargeTime > MAX_CHARGE)
+      {
+        actor.chargeTime = 0;
+        out.add(index, EFFECT_SUPER_BOMB, 1);
+        out.add(index, EFFECT_SPAWN_SHOCKWAVE, MAX_CHARGE);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+// バリアの後、メインスレッドだけで適用する
+void applyEffects(World& world, const std::vector<EffectList>& lists)
+{
+  for (size_t t = 0; t < lists.size(); t++)
+  {
+    const std::vector<Effect>& effects = lists[t].effects;
+    for (size_t i = 0; i < effects.size(); i++)
+    {
+      const Effect& effect = effects[i];
+      switch (effect.type)
+      {
+        case EFFECT_SET_GRAPHICS:
+          world.actors[effect.actor].graphics = Image(effect.value);
+          break;
+        case EFFECT_SUPER_BOMB:
+          world.actors[effect.actor].bombs += effect.value;
+          world.totalBombs += effect.value;
+          break;
+        case EFFECT_SPAWN_SHOCKWAVE:
+        {
+          Shockwave shockwave = { effect.actor, effect.value };
+          world.shockwaves.push_back(shockwave);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// 常駐するワーカーにtask(0)...task(count - 1)を配る。呼び出し側のスレッドはtask(0)を受け持つ
+class WorkerPool
+{
+public:
+  explicit WorkerPool(int threadCount)
+    : generation_(0), finished_(0), quit_(false)
+  {
+    for (int i = 1; i < threadCount; i++)
+    {
+      threads_.push_back(std::thread(&WorkerPool::workerLoop, this, i));
+    }
+  }
+
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++) threads_[i].join();
+  }
+
+  int threadCount() const { return int(threads_.size()) + 1; }
+
+  // 全スレッドがtaskを終えるまで戻らない（バリア）
+  template <class Task>
+  void run(Task task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = task;
+      finished_ = 0;
+      generation_++;
+    }
+    wake_.notify_all();
+
+    task(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return finished_ == threads_.size(); });
+  }
+
+private:
+  void workerLoop(int index)
+  {
+    unsigned seen = 0;
+    for (;;)
+    {
+      std::function<void(int)> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+        if (quit_) return;
+        seen = generation_;
+        task = task_;
+      }
+
+      task(index);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (++finished_ == threads_.size()) done_.notify_one();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::function<void(int)> task_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  unsigned generation_;
+  size_t finished_;
+  bool quit_;
+};
+
+// １フレーム分：並列に進めて、バリアの後で副作用を適用する
+void stepWorld(World& world, const std::vector<int>& inputs, WorkerPool& pool, std::vector<EffectList>& lists)
+{
+  int threads = pool.threadCount();
+  lists.resize(threads);
+  size_t count = world.actors.size();
+  Actor* actors = world.actors.data();    // 各スレッドは自分の範囲だけを書き換える
+  const World& shared = world;            // それ以外は読むだけ
+
+  pool.run([&](int t) {
+    EffectList& out = lists[t];
+    out.effects.clear();
+    size_t begin = count * t / threads;
+    size_t end = count * (t + 1) / threads;
+    for (size_t i = begin; i < end; i++)
+    {
+      stepActor(uint32_t(i), actors[i], inputs[i], shared, out);
+    }
+  });
+
+  applyEffects(world, lists);
+}
+
+}
+
+/*
+ * スレッド数を1からmaxThreadsまで変えて１フレームの時間を測り、結果が同じであることを確かめる
+ */
+void benchmarkParallelFsm(int actorCount, int frames, int maxThreads)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::micro> Microseconds;
+
+  std::vector<int> inputs(size_t(actorCount) * frames);
+  srand(1);
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    // 入力があるのは1割ほど
+    inputs[i] = rand() % 10 == 0 ? rand() % INPUT_COUNT : parallel::NO_INPUT;
+  }
+
+  uint64_t reference = 0;
+  for (int threads = 1; threads <= maxThreads; threads++)
+  {
+    parallel::World world;
+    world.gravity = GRAVITY;
+    world.totalBombs = 0;
+    Actor initial = { STATE_STANDING, IMAGE_STAND, 0, 0, 0 };
+    world.actors.assign(actorCount, initial);
+
+    parallel::WorkerPool pool(threads);
+    std::vector<parallel::EffectList> lists;
+    std::vector<int> frameInputs(actorCount);
+
+    Clock::time_point start = Clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+      std::copy(inputs.begin() + size_t(frame) * actorCount,
+                inputs.begin() + size_t(frame + 1) * actorCount, frameInputs.begin());
+      parallel::stepWorld(world, frameInputs, pool, lists);
+    }
+    double us = Microseconds(Clock::now() - start).count() / frames;
+
+    // 結果を要約して、スレッド数1のときと比べる
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < actorCount; i++)
+    {
+      const Actor& a = world.actors[i];
+      int fields[] = { a.state, a.graphics, a.yVelocity, a.chargeTime, a.bombs };
+      for (int f = 0; f < 5; f++) hash = (hash ^ uint32_t(fields[f])) * 1099511628211ull;
+    }
+    for (size_t i = 0; i < world.shockwaves.size(); i++)
+    {
+      hash = (hash ^ world.shockwaves[i].source) * 1099511628211ull;
+    }
+    if (threads == 1) reference = hash;
+
+    printf("%2d threads: %8.1f us/frame, bombs %d, %s\n",
+           threads, us, world.totalBombs, hash == reference ? "deterministic" : "MISMATCH");
+  }
+}
+
+
+
+/*
+ * 7.13 タイマー・ホイール
+ *  DuckingState::update()（7.3のHeroine::update()も）は毎フレームchargeTime_を増やしてMAX_CHARGEと比べる
+ *  一度しか起きないことのために、アクターの数だけ毎フレーム確かめることになる
+ *  「Nフレーム後に呼んでほしい」をタイマー・ホイールに登録し、状態を抜けるときに取り消す
+ *  待っているだけのアクターは、毎フレーム何もしなくてよい
+ *
+ *  階層型のホイール：各段64個の枠を４段持つ（最大 64^4 - 1 フレーム先）
+ *    - 0段目の枠は１フレーム、1段目の枠は64フレーム、2段目は4096フレーム...を表す
+ *    - 上の段の枠は、その範囲の始まりに来たときに下の段へ移しなおす（カスケード）
+ *  登録、取り消し、発火はどれもO(1)（カスケードは各タイマーにつき最大3回）
+ */
+namespace timer {
+
+class TimerWheel
+{
+public:
+  typedef void (*Callback)(void* context, uint32_t value);
+  typedef TimerHandle Handle;
+
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+  static const uint64_t MAX_DELAY = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+
+  TimerWheel()
+    : now_(0), free_(NONE)
+  {
+    for (int i = 0; i < LEVELS * SLOTS; i++) heads_[i] = NONE;
+  }
+
+  uint64_t now() const { return now_; }
+
+  // delayフレーム後（1以上）のadvance()でcallback(context, value)を呼ぶ
+  Handle schedule(uint64_t delay, Callback callback, void* context, uint32_t value)
+  {
+    if (delay < 1) delay = 1;
+    if (delay > MAX_DELAY) delay = MAX_DELAY;
+
+    int32_t index = free_;
+    if (index == NONE)
+    {
+      index = int32_t(timers_.size());
+      timers_.push_back(Timer());
+      timers_[index].generation = 0;
+    }
+    else
+    {
+      free_ = timers_[index].next;
+    }
+
+    Timer& timer = timers_[index];
+    timer.expires = now_ + delay;
+    timer.callback = callback;
+    timer.context = context;
+    timer.value = value;
+    insert(index);
+
+    Handle handle = { uint32_t(index), timer.generation };
+    return handle;
+  }
+
+  // 発火済みや取り消し済みのハンドルは無視する
+  void cancel(Handle handle)
+  {
+    if (handle.index >= timers_.size()) return;
+    Timer& timer = timers_[handle.index];
+    if (timer.generation != handle.generation || timer.list == NONE) return;
+    unlink(handle.index);
+    release(handle.index);
+  }
+
+  // １フレーム進め、期限の来たタイマーを呼ぶ
+  void advance()
+  {
+    now_++;
+
+    // 各段の範囲の始まりに来たら、その枠を下の段へ移す
+    for (int level = 1; level < LEVELS; level++)
+    {
+      if ((now_ & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) break;
+      cascade(level * SLOTS + int((now_ >> (SLOT_BITS * level)) & (SLOTS - 1)));
+    }
+
+    // コールバックの中で登録や取り消しがあってもよいように、１つずつ取り出す
+    int list = int(now_ & (SLOTS - 1));
+    while (heads_[list] != NONE)
+    {
+      int32_t index = heads_[list];
+      Timer timer = timers_[index];
+      unlink(index);
+      release(index);
+      timer.callback(timer.context, timer.value);
+    }
+  }
+
+private:
+  static const int32_t NONE = -1;
+
+  struct Timer
+  {
+    uint64_t expires;
+    Callback callback;
+    void* context;
+    uint32_t value;
+    uint32_t generation;
+    int32_t list;       // 入っている枠、なければNONE
+    int32_t prev;
+    int32_t next;       // 空きリストでも使う
+  };
+
+  void insert(int32_t index)
+  {
+    Timer& timer = timers_[index];
+    uint64_t delta = timer.expires - now_;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) level++;
+
+    int list = level * SLOTS + int((timer.expires >> (SLOT_BITS * level)) & (SLOTS - 1));
+    timer.list = list;
+    timer.prev = NONE;
+    timer.next = heads_[list];
+    if (timer.next != NONE) timers_[timer.next].prev = index;
+    heads_[list] = index;
+  }
+
+  void unlink(int32_t index)
+  {
+    Timer& timer = timers_[index];
+    if (timer.prev != NONE) timers_[timer.prev].next = timer.next;
+    else                    heads_[timer.list] = timer.next;
+    if (timer.next != NONE) timers_[timer.next].prev = timer.prev;
+    timer.list = NONE;
+  }
+
+  void release(int32_t index)
+  {
+    Timer& timer = timers_[index];
+    timer.generation++;
+    timer.next = free_;
+    free_ = index;
+  }
+
+  void cascade(int list)
+  {
+    int32_t index = heads_[list];
+    heads_[list] = NONE;
+    while (index != NONE)
+    {
+      int32_t next = timers_[index].next;
+      insert(index);
+      index = next;
+    }
+  }
+
+  uint64_t now_;
+  std::vector<Timer> timers_;
+  int32_t free_;
+  int32_t heads_[LEVELS * SLOTS];
+};
+
+}
+
+/*
+ * 7.10の状態オブジェクトから使う：屈んだらタイマーを登録し、立ち上がったら取り消す
+ * ホイールはゲーム全体で１つ、毎フレームadvance()する
+ */
+timer::TimerWheel gameTimers;
+
+namespace inplace {
+
+void TimedDuckingState::enter(Heroine& heroine)
+{
+  heroine_ = &heroine;
+  heroine.setGraphics(IMAGE_DUCK);
+  charge_ = gameTimers.schedule(MAX_CHARGE + 1, &TimedDuckingState::charged, this, 0);
+}
+
+void TimedDuckingState::exit(Heroine& heroine)
+{
+  gameTimers.cancel(charge_);
+}
+
+void TimedDuckingState::handleInput(Heroine& heroine, Input input)
+{
+  if (input == RELEASE_DOWN) heroine.transitionTo<StandingState>();
+}
+
+void TimedDuckingState::charged(void* context, uint32_t value)
+{
+  TimedDuckingState* state = static_cast<TimedDuckingState*>(context);
+  state->heroine_->superBomb();
+  state->charge_ = gameTimers.schedule(MAX_CHARGE + 1, &TimedDuckingState::charged, state, 0);
+}
+
+}
+
+/*
+ * 同じ入力を、7.10のDuckingState（毎フレーム数える）とTimedDuckingStateに与えて、
+ * 爆弾の数が同じになることと、立ち上がったらタイマーが止まることを確かめる
+ */
+void checkTimedDucking(int frames)
+{
+  inplace::Heroine polled;
+  inplace::Heroine timed;
+
+  polled.handleInput(PRESS_DOWN);
+  timed.transitionTo<inplace::TimedDuckingState>();
+  timed.update();     // Standingのupdate()は何もせず、予約した遷移だけが行われる
+
+  for (int frame = 0; frame < frames; frame++)
+  {
+    polled.update();
+    timed.update();
+    gameTimers.advance();
+    assert(polled.data().bombs == timed.data().bombs);
+  }
+
+  polled.handleInput(RELEASE_DOWN);
+  timed.handleInput(RELEASE_DOWN);
+  for (int frame = 0; frame < 2 * MAX_CHARGE; frame++) gameTimers.advance();
+
+  assert(polled.data().bombs == timed.data().bombs);
+  assert(timed.data().graphics == IMAGE_STAND);
+  printf("ducking for %d frames: %d bombs (polled), %d bombs (timer)\n",
+         frames, polled.data().bombs, timed.data().bombs);
+}
+
+/*
+ * 屈んでいる100k体の１フレームの時間を、毎フレームのポーリングとタイマー・ホイールで比べる
+ * MAX_CHARGEは60フレームと短く、全員がほぼ毎秒発火して登録しなおすので、ここではホイールの方が遅いこともある
+ * ホイールが効くのは、待ちが長く、ほとんどのアクターが何もせずに待っているとき（benchmarkLongWaits）
+ */
+namespace {
+
+void addBomb(void* context, uint32_t actor)
+{
+  std::vector<Actor>& actors = *static_cast<std::vector<Actor>*>(context);
+  actors[actor].bombs++;
+}
+
+struct WheelBenchmark
+{
+  timer::TimerWheel wheel;
+  std::vector<Actor> actors;
+
+  static void charged(void* context, uint32_t actor)
+  {
+    WheelBenchmark& self = *static_cast<WheelBenchmark*>(context);
+    addBomb(&self.actors, actor);
+    self.wheel.schedule(MAX_CHARGE + 1, &WheelBenchmark::charged, &self, actor);
+  }
+};
+
+}
+
+void benchmarkChargeTimers(int actorCount, int frames)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::micro> Microseconds;
+
+  srand(1);
+  std::vector<Actor> polled(actorCount);
+  WheelBenchmark timed;
+  timed.actors.resize(actorCount);
+  for (int i = 0; i < actorCount; i++)
+  {
+    Actor actor = { STATE_DUCKING, IMAGE_DUCK, 0, rand() % MAX_CHARGE, 0 };
+    polled[i] = actor;
+    timed.actors[i] = actor;
+    // chargeTimeがcなら、ポーリング版は (MAX_CHARGE + 1 - c) フレーム後に発火する
+    timed.wheel.schedule(MAX_CHARGE + 1 - actor.chargeTime, &WheelBenchmark::charged, &timed, i);
+  }
+
+  Clock::time_point t0 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    for (int i = 0; i < actorCount; i++) updateDucking(polled[i]);
+  }
+  Clock::time_point t1 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    timed.wheel.advance();
+  }
+  Clock::time_point t2 = Clock::now();
+
+  long polledBombs = 0;
+  long timedBombs = 0;
+  for (int i = 0; i < actorCount; i++)
+  {
+    polledBombs += polled[i].bombs;
+    timedBombs += timed.actors[i].bombs;
+  }
+
+  printf("polling    : %8.1f us/frame, %ld bombs\n", Microseconds(t1 - t0).count() / frames, polledBombs);
+  printf("timer wheel: %8.1f us/frame, %ld bombs\n", Microseconds(t2 - t1).count() / frames, timedBombs);
+}
+
+/*
+ * 待ちの長いタイマー：リスポーンや、しばらく放っておかれたときの待機アニメーションなど
+ * 各アクターは1..maxWaitフレームのどこかで１回だけ発火する。発火するまでは待っているだけ
+ * ポーリング版は待っているアクターも毎フレーム数え直すが、ホイールは発火するものとカスケードにしか触れない
+ */
+void benchmarkLongWaits(int actorCount, int frames, int maxWait)
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::chrono::duration<double, std::micro> Microseconds;
+
+  srand(1);
+  std::vector<Actor> polled(actorCount);
+  std::vector<Actor> waiting(actorCount);
+  timer::TimerWheel wheel;
+  for (int i = 0; i < actorCount; i++)
+  {
+    int wait = 1 + rand() % maxWait;
+    Actor actor = { STATE_STANDING, IMAGE_STAND, 0, wait, 0 };
+    polled[i] = actor;
+    waiting[i] = actor;
+    wheel.schedule(wait, addBomb, &waiting, i);
+  }
+
+  Clock::time_point t0 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    for (int i = 0; i < actorCount; i++)
+    {
+      Actor& actor = polled[i];
+      if (actor.chargeTime > 0 && --actor.chargeTime == 0) actor.bombs++;
+    }
+  }
+  Clock::time_point t1 = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    wheel.advance();
+  }
+  Clock::time_point t2 = Clock::now();
+
+  long polledFired = 0;
+  long timedFired = 0;
+  for (int i = 0; i < actorCount; i++)
+  {
+    polledFired += polled[i].bombs;
+    timedFired += waiting[i].bombs;
+  }
+  assert(polledFired == timedFired);
+
+  printf("waits up to %d frames, polling    : %8.1f us/frame, %ld fired\n",
+         maxWait, Microseconds(t1 - t0).count() / frames, polledFired);
+  printf("waits up to %d frames, timer wheel: %8.1f us/frame, %ld fired\n",
+         maxWait, Microseconds(t2 - t1).count() / frames, timedFired);
+}
+
+
+
+/*
+ * 7.14 状態機械の計測
+ *  ゲームプレイも性能も計測値を見て調整したいが、Heroineの状態機械は
+ *  どれだけ遷移しているのか、各状態にどれだけ留まっているのかが見えない
+ *    - 状態ごとの進入回数と、遷移行列 [from][to]
+ *    - 状態に留まったフレーム数のヒストグラム（2の冪の区間）
+ *    - 状態ごとのhandleInput()/update()のCPU時間
+ *  集計はスレッドごとの領域に書くのでロックは要らない。まとめるのは書き出すときだけ
+ *  書き出しはChromeのtrace event形式（chrome://tracingやPerfettoで開ける）と、テキストの要約
+ *  FSM_PROFILINGが0なら、計測用のマクロは空になり、何のコストもかからない
+ */
+#ifndef FSM_PROFILING
+#define FSM_PROFILING 0
+#endif
+
+#if FSM_PROFILING
+
+namespace profiling {
+
+enum Phase
+{
+  PHASE_HANDLE_INPUT,
+  PHASE_UPDATE,
+
+  PHASE_COUNT
+};
+
+const int HISTOGRAM_BUCKETS = 16;     // [1], [2,3], [4,7], ... フレーム
+const size_t MAX_TRACE_EVENTS = 1 << 20;    // スレッドごと。超えた分は数えるだけで捨てる
+
+const char* const STATE_NAMES[STATE_COUNT] = { "standing", "jumping", "ducking", "diving" };
+const char* const PHASE_NAMES[PHASE_COUNT] = { "handleInput", "update" };
+
+inline int histogramBucket(uint32_t frames)
+{
+  int bucket = 0;
+  while (frames > 1 && bucket < HISTOGRAM_BUCKETS - 1)
+  {
+    frames >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+inline uint64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// スレッドごとの集計。書くのはそのスレッドだけ
+struct FsmStats
+{
+  uint64_t entries[STATE_COUNT];
+  uint64_t transitions[STATE_COUNT][STATE_COUNT];
+  uint64_t timeInState[STATE_COUNT][HISTOGRAM_BUCKETS];
+  uint64_t calls[STATE_COUNT][PHASE_COUNT];
+  uint64_t ns[STATE_COUNT][PHASE_COUNT];
+
+  // 現在のフレームの分。endFrame()でトレースのイベントにする
+  uint64_t frameStart;
+  uint64_t frameNs[STATE_COUNT][PHASE_COUNT];
+  uint64_t frameTransitions;
+
+  struct TraceEvent
+  {
+    uint64_t start;
+    uint64_t duration;
+    int state;
+    int phase;              // PHASE_COUNTなら遷移数のカウンタ
+    uint64_t value;
+  };
+  std::vector<TraceEvent> events;
+  uint64_t droppedEvents;
+  int thread;
+};
+
+class FsmProfiler
+{
+public:
+  FsmProfiler()
+    : origin_(nowNs())
+  {}
+
+  ~FsmProfiler()
+  {
+    for (size_t i = 0; i < threads_.size(); i++) delete threads_[i];
+  }
+
+  // 初回だけ確保とロックがある
+  FsmStats& local()
+  {
+    static thread_local FsmStats* stats = NULL;
+    if (!stats)
+    {
+      stats = new FsmStats();
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats->thread = int(threads_.size());
+      stats->frameStart = nowNs();
+      threads_.push_back(stats);
+    }
+    return *stats;
+  }
+
+  // 各スレッドが、そのフレームの自分の分を終えたときに呼ぶ
+  // 状態ごとの合計時間なので、同じスレッドのイベントが重ならないようフレームの始まりから順に並べる
+  void endFrame()
+  {
+    FsmStats& stats = local();
+    uint64_t start = stats.frameStart;
+    for (int s = 0; s < STATE_COUNT; s++)
+    {
+      for (int p = 0; p < PHASE_COUNT; p++)
+      {
+        if (stats.frameNs[s][p] == 0) continue;
+        FsmStats::TraceEvent event = { start, stats.frameNs[s][p], s, p, 0 };
+        addEvent(stats, event);
+        start += stats.frameNs[s][p];
+        stats.frameNs[s][p] = 0;
+      }
+    }
+    FsmStats::TraceEvent counter = { stats.frameStart, 0, 0, PHASE_COUNT, stats.frameTransitions };
+    addEvent(stats, counter);
+    stats.frameTransitions = 0;
+    stats.frameStart = nowNs();
+  }
+
+  // 以下は、計測しているスレッドが止まっているときに呼ぶ
+  void writeTrace(FILE* file) const;
+  void writeSummary(FILE* file) const;
+
+private:
+  static void addEvent(FsmStats& stats, const FsmStats::TraceEvent& event)
+  {
+    if (stats.events.size() < MAX_TRACE_EVENTS) stats.events.push_back(event);
+    else                                        stats.droppedEvents++;
+  }
+
+  uint64_t origin_;
+  std::vector<FsmStats*> threads_;
+  std::mutex mutex_;
+};
+
+FsmProfiler fsmProfiler;
+
+// スコープの間のCPU時間を、状態とフェーズに加算する
+class ScopeTimer
+{
+public:
+  ScopeTimer(int state, Phase phase)
+    : stats_(fsmProfiler.local()), state_(state), phase_(phase), start_(nowNs())
+  {}
+
+  ~ScopeTimer()
+  {
+    uint64_t elapsed = nowNs() - start_;
+    stats_.calls[state_][phase_]++;
+    stats_.ns[state_][phase_] += elapsed;
+    stats_.frameNs[state_][phase_] += elapsed;
+  }
+
+private:
+  FsmStats& stats_;
+  int state_;
+  Phase phase_;
+  uint64_t start_;
+};
+
+inline void recordTransition(int from, int to, uint32_t framesInState)
+{
+  FsmStats& stats = fsmProfiler.local();
+  stats.entries[to]++;
+  stats.transitions[from][to]++;
+  stats.timeInState[from][histogramBucket(framesInState)]++;
+  stats.frameTransitions++;
+}
+
+// "X"は時間幅のあるイベント、"C"はカウンタ。時刻の単位はマイクロ秒
+void FsmProfiler::writeTrace(FILE* file) const
+{
+  fprintf(file, "{\"traceEvents\":[\n");
+  const char* separator = "";
+  for (size_t t = 0; t < threads_.size(); t++)
+  {
+    const FsmStats& stats = *threads_[t];
+    for (size_t i = 0; i < stats.events.size(); i++)
+    {
+      const FsmStats::TraceEvent& event = stats.events[i];
+      double ts = (event.start - origin_) / 1000.0;
+      if (event.phase == PHASE_COUNT)
+      {
+        fprintf(file, "%s{\"name\":\"transitions\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                "\"args\":{\"count\":%llu}}",
+                separator, stats.thread, ts, (unsigned long long)event.value);
+      }
+      else
+      {
+        fprintf(file, "%s{\"name\":\"%s::%s\",\"cat\":\"fsm\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                separator, STATE_NAMES[event.state], PHASE_NAMES[event.phase],
+                stats.thread, ts, event.duration / 1000.0);
+      }
+      separator = ",\n";
+    }
+  }
+  fprintf(file, "\n]}\n");
+}
+
+void FsmProfiler::writeSummary(FILE* file) const
+{
+  FsmStats total = FsmStats();
+  for (size_t t = 0; t < threads_.size(); t++)
+  {
+    const FsmStats& stats = *threads_[t];
+    total.droppedEvents += stats.droppedEvents;
+    for (int s = 0; s < STATE_COUNT; s++)
+    {
+      total.entries[s] += stats.entries[s];
+      for (int to = 0; to < STATE_COUNT; to++) total.transitions[s][to] += stats.transitions[s][to];
+      for (int b = 0; b < HISTOGRAM_BUCKETS; b++) total.timeInState[s][b] += stats.timeInState[s][b];
+      for (int p = 0; p < PHASE_COUNT; p++)
+      {
+        total.calls[s][p] += stats.calls[s][p];
+        total.ns[s][p] += stats.ns[s][p];
+      }
+    }
+  }
+
+  fprintf(file, "%-10s %10s %14s %14s\n", "state", "entries", "handleInput ns", "update ns");
+  for (int s = 0; s < STATE_COUNT; s++)
+  {
+    fprintf(file, "%-10s %10llu %14.1f %14.1f\n", STATE_NAMES[s],
+            (unsigned long long)total.entries[s],
+            total.calls[s][PHASE_HANDLE_INPUT] ? double(total.ns[s][PHASE_HANDLE_INPUT]) / total.calls[s][PHASE_HANDLE_INPUT] : 0.0,
+            total.calls[s][PHASE_UPDATE] ? double(total.ns[s][PHASE_UPDATE]) / total.calls[s][PHASE_UPDATE] : 0.0);
+  }
+
+  fprintf(file, "\ntransitions (row = from, column = to)\n%-10s", "");
+  for (int to = 0; to < STATE_COUNT; to++) fprintf(file, " %10s", STATE_NAMES[to]);
+  fprintf(file, "\n");
+  for (int from = 0; from < STATE_COUNT; from++)
+  {
+    fprintf(file, "%-10s", STATE_NAMES[from]);
+    for (int to = 0; to < STATE_COUNT; to++)
+    {
+      fprintf(file, " %10llu", (unsigned long long)total.transitions[from][to]);
+    }
+    fprintf(file, "\n");
+  }
+
+  fprintf(file, "\nframes in state (bucket b = [2^b, 2^(b+1)) frames)\n");
+  for (int s = 0; s < STATE_COUNT; s++)
+  {
+    fprintf(file, "%-10s", STATE_NAMES[s]);
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+      fprintf(file, " %llu", (unsigned long long)total.timeInState[s][b]);
+    }
+    fprintf(file, "\n");
+  }
+
+  if (total.droppedEvents)
+  {
+    fprintf(file, "\n%llu trace events dropped (limit %zu per thread)\n",
+            (unsigned long long)total.droppedEvents, MAX_TRACE_EVENTS);
+  }
+}
+
+// トレースをtracePathに、要約をsummaryに書き出す
+inline void writeReport(const char* tracePath, FILE* summary)
+{
+  if (FILE* trace = fopen(tracePath, "w"))
+  {
+    fsmProfiler.writeTrace(trace);
+    fclose(trace);
+  }
+  fsmProfiler.writeSummary(summary);
+}
+
+}
+
+#define FSM_PROFILE_CONCAT2(a, b) a##b
+#define FSM_PROFILE_CONCAT(a, b) FSM_PROFILE_CONCAT2(a, b)
+#define FSM_PROFILE_SCOPE(state, phase) \
+    profiling::ScopeTimer FSM_PROFILE_CONCAT(fsmScope, __LINE__)((state), profiling::phase)
+#define FSM_PROFILE_TRANSITION(from, to, frames) profiling::recordTransition((from), (to), (frames))
+#define FSM_PROFILE_END_FRAME() profiling::fsmProfiler.endFrame()
+#define FSM_PROFILE_REPORT(tracePath, summary) profiling::writeReport((tracePath), (summary))
+
+#else
+
+#define FSM_PROFILE_SCOPE(state, phase) do {} while (false)
+#define FSM_PROFILE_TRANSITION(from, to, frames) do {} while (false)
+#define FSM_PROFILE_END_FRAME() do {} while (false)
+#define FSM_PROFILE_REPORT(tracePath, summary) do {} while (false)
+
+#endif
+
+/*
+ * 計測を入れた入力処理と更新（7.8の遷移表、7.9の状態ごとの更新を使う）
+ * enteredFrameは、そのアクターが今の状態に入ったフレーム
+ */
+inline void profiledHandleInput(Actor& actor, Input input, uint32_t& enteredFrame, uint32_t frame)
+{
+  State from = actor.state;
+  {
+    FSM_PROFILE_SCOPE(from, PHASE_HANDLE_INPUT);
+    handleInput(actor, input);
+  }
+  if (actor.state != from)
+  {
+    FSM_PROFILE_TRANSITION(from, actor.state, frame - enteredFrame);
+    enteredFrame = frame;
+  }
+}
+
+inline void profiledUpdate(Actor& actor, uint32_t& enteredFrame, uint32_t frame)
+{
+  static bool (* const UPDATES[STATE_COUNT])(Actor&) =
+  {
+    updateStanding, updateJumping, updateDucking, updateDiving
+  };
+
+  bool landed;
+  {
+    FSM_PROFILE_SCOPE(actor.state, PHASE_UPDATE);
+    landed = UPDATES[actor.state](actor);
+  }
+  if (landed) profiledHandleInput(actor, LAND, enteredFrame, frame);
+}
+
+// フレームの最後に
+FSM_PROFILE_END_FRAME();
+
+// 終了時に
+FSM_PROFILE_REPORT("fsm_trace.json", stdout);
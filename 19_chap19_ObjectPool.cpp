@@ -7,8 +7,11 @@
 
 ************************/
 
+#include<chrono>
+#include<cmath>
 #include<cstdint>
 #include<cstdio>
+#include<cstdlib>
 
 //#define NDEBUG
 #include<cassert>
@@ -208,6 +211,178 @@ private:
     bool inUse_[POOL_SIZE];
 };
 
+/************************************************************/
+/*
+   Reduced-precision particles
+
+   Particle spends 32 bytes on doubles that effects never need. PackedParticle
+   takes a precision policy and stores positions relative to the emitter origin,
+   so the pool passes the origin back in on getX()/getY().
+
+   - DoublePrecision: same arithmetic as Particle, 40 bytes
+   - FloatPrecision : 24 bytes. Error after n frames is at most
+                      (n + 2) * 2^-24 * R, where R is the largest distance from
+                      the origin the particle reaches (or its largest per-frame
+                      velocity, if that is bigger)
+   - FixedPrecision : 16-bit fixed point with 8 fraction bits, 16 bytes.
+                      Positions must stay within +-128 units of the origin and
+                      velocities within +-128 units per frame. Position and
+                      velocity are each rounded to 1/256 on init and the
+                      velocity error accumulates every frame, so the error after
+                      n frames is at most (n + 1) / 512 units
+ */
+
+struct DoublePrecision
+{
+    typedef double Value;
+    static Value encode(double v) { return v; }
+    static double decode(Value v) { return v; }
+    static Value advance(Value position, Value velocity) { return position + velocity; }
+};
+
+struct FloatPrecision
+{
+    typedef float Value;
+    static Value encode(double v) { return static_cast<float>(v); }
+    static double decode(Value v) { return v; }
+    static Value advance(Value position, Value velocity) { return position + velocity; }
+};
+
+struct FixedPrecision
+{
+    typedef int16_t Value;
+    static const int FRACTION_BITS = 8;
+    static constexpr double SCALE = 1 << FRACTION_BITS;
+
+    static Value encode(double v)
+    {
+        long fixed = lround(v * SCALE);
+        assert(fixed >= INT16_MIN && fixed <= INT16_MAX);
+        return static_cast<Value>(fixed);
+    }
+    static double decode(Value v) { return v / SCALE; }
+
+    // int16 would wrap silently once a particle leaves the +-128 range
+    static Value advance(Value position, Value velocity)
+    {
+        int next = position + velocity;
+        assert(next >= INT16_MIN && next <= INT16_MAX);
+        return static_cast<Value>(next);
+    }
+};
+
+
+template <class Precision>
+class PackedParticle
+{
+public:
+    typedef typename Precision::Value Value;
+
+    PackedParticle()
+        : frameLeft_(0)
+    {}
+
+    void init(double x, double y,
+            double xVel, double yVel, int lifetime)
+    {
+        state_.live.x_ = Precision::encode(x);
+        state_.live.y_ = Precision::encode(y);
+        state_.live.xVel_ = Precision::encode(xVel);
+        state_.live.yVel_ = Precision::encode(yVel);
+        frameLeft_ = lifetime;
+    }
+
+    bool animate()
+    {
+        if (!inUse())   return false;
+
+        frameLeft_--;
+        state_.live.x_ = Precision::advance(state_.live.x_, state_.live.xVel_);
+        state_.live.y_ = Precision::advance(state_.live.y_, state_.live.yVel_);
+
+        return frameLeft_ == 0;
+    }
+
+    bool inUse() const { return frameLeft_ > 0; }
+    PackedParticle* getNext() const { return state_.next; }
+    void setNext(PackedParticle* next) { state_.next = next; }
+
+    double getX(double originX) const { return originX + Precision::decode(state_.live.x_); }
+    double getY(double originY) const { return originY + Precision::decode(state_.live.y_); }
+
+private:
+    int frameLeft_;
+
+    union
+    {
+        struct
+        {
+            Value x_, y_, xVel_, yVel_;
+        } live;
+
+        PackedParticle* next;
+    } state_;
+
+};
+
+
+template <class Precision, int POOL_SIZE = 100>
+class PackedParticlePool
+{
+public:
+    typedef PackedParticle<Precision> Particle;
+
+    PackedParticlePool(double originX, double originY)
+        : originX_(originX),
+          originY_(originY)
+    {
+        firstAvailable_ = &particles_[0];
+
+        for (int i = 0; i < POOL_SIZE - 1; i++)
+        {
+            particles_[i].setNext(&particles_[i+1]);
+        }
+
+        particles_[POOL_SIZE - 1].setNext(nullptr);
+    }
+
+    // x and y are world coordinates, as for ParticlePool::create()
+    void create(double x, double y,
+            double xVel, double yVel,
+            int lifetime)
+    {
+        assert(firstAvailable_ != nullptr);
+
+        Particle* newParticle = firstAvailable_;
+        firstAvailable_ = firstAvailable_->getNext();
+
+        newParticle->init(x - originX_, y - originY_, xVel, yVel, lifetime);
+    }
+
+    void animate()
+    {
+        for (int i = 0; i < POOL_SIZE; i++)
+        {
+            if (particles_[i].animate())
+            {
+                particles_[i].setNext(firstAvailable_);
+                firstAvailable_ = &particles_[i];
+            }
+        }
+    }
+
+    bool inUse(int i) const { return particles_[i].inUse(); }
+    double getX(int i) const { return particles_[i].getX(originX_); }
+    double getY(int i) const { return particles_[i].getY(originY_); }
+
+private:
+    double originX_;
+    double originY_;
+    Particle particles_[POOL_SIZE];
+    Particle* firstAvailable_;
+
+};
+
 /************************************************************/
 /*
    test
@@ -242,11 +417,136 @@ void test_particleForPool2()
 }
 
 
+// every mode must track the double reference within its documented bound
+template <class Precision>
+double maxPackedError(int lifetime)
+{
+    const int COUNT = 100;
+    const double ORIGIN_X = 1000.0;
+    const double ORIGIN_Y = -500.0;
+
+    PackedParticlePool<Precision, COUNT>* pool =
+        new PackedParticlePool<Precision, COUNT>(ORIGIN_X, ORIGIN_Y);
+    double x[COUNT], y[COUNT], xVel[COUNT], yVel[COUNT];
+
+    srand(1);
+    for (int i = 0; i < COUNT; i++)
+    {
+        // keep within +-128 units of the origin for the whole lifetime
+        x[i] = ORIGIN_X + (rand() % 1000 - 500) / 10.0;
+        y[i] = ORIGIN_Y + (rand() % 1000 - 500) / 10.0;
+        xVel[i] = (rand() % 100 - 50) / 70.0;
+        yVel[i] = (rand() % 100 - 50) / 70.0;
+        pool->create(x[i], y[i], xVel[i], yVel[i], lifetime);
+    }
+
+    double maxError = 0.0;
+    for (int frame = 0; frame < lifetime - 1; frame++)
+    {
+        pool->animate();
+        for (int i = 0; i < COUNT; i++)
+        {
+            x[i] += xVel[i];
+            y[i] += yVel[i];
+            assert(pool->inUse(i));
+            maxError = fmax(maxError, fabs(pool->getX(i) - x[i]));
+            maxError = fmax(maxError, fabs(pool->getY(i) - y[i]));
+        }
+    }
+
+    delete pool;
+    return maxError;
+}
+
+
+bool test_packedParticleError()
+{
+    const int LIFETIME = 60;
+    const double R = 128.0;
+    const double floatBound = (LIFETIME + 2) * R / (1 << 24);
+    const double fixedBound = (LIFETIME + 1) / 512.0;
+
+    double doubleError = maxPackedError<DoublePrecision>(LIFETIME);
+    double floatError = maxPackedError<FloatPrecision>(LIFETIME);
+    double fixedError = maxPackedError<FixedPrecision>(LIFETIME);
+
+    printf("max error over %d frames: double %.2e, float %.2e, fixed %.2e\n",
+            LIFETIME, doubleError, floatError, fixedError);
+
+    // the double pool works relative to the origin, so it differs from the
+    // world-space reference only by rounding
+    bool ok = true;
+    if (doubleError >= 1e-9)
+    {
+        printf("FAILED: double error %.2e is not below 1e-9\n", doubleError);
+        ok = false;
+    }
+    if (floatError > floatBound)
+    {
+        printf("FAILED: float error %.2e exceeds %.2e\n", floatError, floatBound);
+        ok = false;
+    }
+    if (fixedError > fixedBound)
+    {
+        printf("FAILED: fixed error %.2e exceeds %.2e\n", fixedError, fixedBound);
+        ok = false;
+    }
+    return ok;
+}
+
+
+template <class Precision>
+void benchmarkPackedPool(const char* name)
+{
+    const int COUNT = 100000;
+    const int FRAMES = 200;
+    typedef PackedParticlePool<Precision, COUNT> Pool;
+
+    Pool* pool = new Pool(0.0, 0.0);
+
+    srand(1);
+    for (int i = 0; i < COUNT; i++)
+    {
+        // 50 + 0.35 * FRAMES stays inside the +-128 range FixedPrecision can hold
+        pool->create((rand() % 1000 - 500) / 10.0, (rand() % 1000 - 500) / 10.0,
+                (rand() % 70 - 35) / 100.0, (rand() % 70 - 35) / 100.0,
+                FRAMES + 1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < FRAMES; frame++)
+    {
+        pool->animate();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("%-7s: %2zu bytes/particle, %7zu KiB/pool, %.2f ns per particle-frame\n",
+            name, sizeof(typename Pool::Particle), sizeof(Pool) / 1024,
+            ns / (double(COUNT) * FRAMES));
+
+    delete pool;
+}
+
+
+void benchmark_particleStorage()
+{
+    benchmarkPackedPool<DoublePrecision>("double");
+    benchmarkPackedPool<FloatPrecision>("float");
+    benchmarkPackedPool<FixedPrecision>("fixed");
+}
+
+
+
 int main()
 {
     test_particlePool();
 
     test_particleForPool2();
 
+    if (!test_packedParticleError())    return 1;
+
+    benchmark_particleStorage();
+
     return 0;
 }
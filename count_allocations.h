@@ -0,0 +1,32 @@
+/*
+	ヒープ確保の回数とバイト数を数える
+	グローバルなoperator new/deleteを置き換えるので、プログラム中のすべての確保が少し遅くなる
+	そのため各章の計測では、COUNT_ALLOCATIONSを1にしてビルドしたときだけ取り込む
+
+		#if COUNT_ALLOCATIONS
+		#include "count_allocations.h"
+		#endif
+
+	operator newの定義はプログラムに１つしか置けないので、取り込むのは１つの翻訳単位だけにすること
+*/
+#ifndef COUNT_ALLOCATIONS_H
+#define COUNT_ALLOCATIONS_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> allocationCount(0);
+static std::atomic<size_t> allocatedBytes(0);
+
+void* operator new(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	if (void* p = malloc(size)) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+#endif